@@ -0,0 +1,626 @@
+-- convert headers to their wire format once at enqueue time, so the worker doesn't expand jsonb on dequeue
+-- API: Private
+create or replace function net._encode_headers(headers jsonb)
+    -- `Name: value` header lines
+    returns text[]
+    language sql
+    immutable
+as $$
+    select array(select key || ': ' || value from jsonb_each_text(headers))
+$$;
+
+alter table net.http_request_queue
+  alter column headers type text[] using net._encode_headers(headers);
+
+alter table net.http_request_queue add column extract jsonb;
+
+alter table net._http_response add column extracted jsonb;
+
+-- Evaluates the name/json path pairs of a request's `extract` on its json response body, only the
+-- extracted values are stored, see extract_json_responses in the worker
+-- API: Private
+create or replace function net._extract_json(doc jsonb, extract jsonb)
+    -- name/extracted value pairs, a path that matches nothing extracts null
+    returns jsonb
+    language sql
+    immutable
+    strict
+as $$
+    select coalesce(jsonb_object_agg(key, jsonb_path_query_first(doc, value::jsonpath, silent => true)), '{}')
+    from jsonb_each_text(extract)
+$$;
+
+-- The body as jsonb, or null when it isn't json. Only used for the batches that have a body that
+-- isn't json, since each call opens a subtransaction
+-- API: Private
+create or replace function net._to_jsonb(body text)
+    returns jsonb
+    language plpgsql
+    immutable
+    strict
+as $$
+begin
+    return body::jsonb;
+exception when others then
+    return null;
+end
+$$;
+
+alter table net.http_request_queue
+  add column traceparent text,
+  add column enqueued_at timestamptz;
+
+-- The spans of the requests sent while pg_net.tracing was on, following the W3C trace context
+-- API: Private
+create unlogged table net._http_request_span(
+    id bigint not null,
+    trace_id text not null,
+    span_id text not null,
+    -- the span id of the caller's pg_net.traceparent
+    parent_span_id text,
+    enqueued_at timestamptz not null,
+    dequeued_at timestamptz not null,
+    -- when the request was sent, after DNS, TCP and TLS setup
+    sent_at timestamptz,
+    first_byte_at timestamptz,
+    completed_at timestamptz not null
+);
+
+create index on net._http_request_span (id);
+
+grant all on net._http_request_span to PUBLIC;
+
+-- The trace context a request is enqueued with, null when pg_net.tracing is off. Otherwise it's
+-- the caller's pg_net.traceparent, empty when there's none
+-- API: Private
+create or replace function net._traceparent()
+    returns text
+    language sql
+    stable
+as $$
+    select case
+        when current_setting('pg_net.tracing', true)::bool
+        then coalesce(current_setting('pg_net.traceparent', true), '')
+    end
+$$;
+
+-- url encode the params and append them to the url in a single pass, see net.http_get
+-- API: Private
+create or replace function net._encode_url_with_params(url text, params jsonb)
+    -- url with the encoded params in its query
+    returns text
+    language 'c'
+    immutable
+as 'MODULE_PATHNAME';
+
+alter table net.http_request_queue add column aggregate_key text;
+
+alter table net.http_request_queue add column priority int not null default 0;
+
+alter table net.http_request_queue
+    add column tenant text not null default coalesce(nullif(current_setting('pg_net.tenant', true), ''), current_user::text);
+
+create index on net.http_request_queue(tenant, id);
+
+alter table net.http_request_queue
+    alter column url drop not null,
+    add column template text,
+    add column params text,
+    add check (url is not null or template is not null);
+
+-- The templates of net.http_prepared, see net.prepare_request
+-- API: Private
+create table net._http_request_template(
+    name text primary key check (octet_length(name) < 64),
+    method net.http_method not null,
+    url text not null,
+    -- `Name: value` lines, see net._encode_headers
+    headers text[],
+    timeout_milliseconds int not null,
+    extract jsonb
+);
+
+select pg_catalog.pg_extension_config_dump('net._http_request_template', '');
+
+grant all on net._http_request_template to PUBLIC;
+
+-- url encode the params into a query string, see net.http_prepared
+-- API: Private
+create or replace function net._encode_params(params jsonb)
+    returns text
+    language 'c'
+    immutable
+as 'MODULE_PATHNAME';
+
+-- Counts the request in the approximate queue depth, applying pg_net.queue_full_policy when the
+-- queue has pg_net.queue_max_depth requests
+-- API: Private
+create or replace function net._admit_request(priority int)
+  returns void
+  language 'c'
+as 'MODULE_PATHNAME';
+
+-- the request functions get new parameters, the old ones are kept until their privileges are
+-- copied at the end of this script
+alter function net.http_get(text, jsonb, jsonb, integer) rename to _http_get_0_20;
+alter function net.http_post(text, jsonb, jsonb, jsonb, integer) rename to _http_post_0_20;
+alter function net.http_delete(text, jsonb, jsonb, integer, jsonb) rename to _http_delete_0_20;
+
+-- Interface to make an async request
+-- API: Public
+create or replace function net.http_get(
+    -- url for the request
+    url text,
+    -- key/value pairs to be url encoded and appended to the `url`
+    params jsonb default '{}'::jsonb,
+    -- key/values to be included in request headers
+    headers jsonb default '{}'::jsonb,
+    -- the maximum number of milliseconds the request may take before being cancelled
+    timeout_milliseconds int default 5000,
+    -- name/json path pairs, when given only the values they extract from a json response body are stored
+    extract jsonb default null,
+    -- when the queue is full and pg_net.queue_full_policy is 'drop', lower priorities are dropped first
+    priority int default 0
+)
+    -- request_id reference
+    returns bigint
+    language plpgsql
+as $$
+declare
+    request_id bigint;
+    trace_parent text := net._traceparent();
+begin
+    -- invalid json paths fail here instead of in the worker
+    perform value::jsonpath from jsonb_each_text(extract);
+
+    -- errors, waits or makes room when the queue is full, see pg_net.queue_full_policy
+    perform net._admit_request(priority);
+
+    -- Add to the request queue
+    insert into net.http_request_queue(method, url, headers, timeout_milliseconds, extract, traceparent, enqueued_at, priority)
+    values (
+        'GET',
+        net._encode_url_with_params(url, params),
+        net._encode_headers(headers),
+        timeout_milliseconds,
+        extract,
+        trace_parent,
+        case when trace_parent is not null then clock_timestamp() end,
+        priority
+    )
+    returning id
+    into request_id;
+
+    perform net.wake();
+
+    return request_id;
+end
+$$;
+
+-- Interface to make an async request
+-- API: Public
+create or replace function net.http_post(
+    -- url for the request
+    url text,
+    -- body of the POST request
+    body jsonb default '{}'::jsonb,
+    -- key/value pairs to be url encoded and appended to the `url`
+    params jsonb default '{}'::jsonb,
+    -- key/values to be included in request headers
+    headers jsonb default '{"Content-Type": "application/json"}'::jsonb,
+    -- the maximum number of milliseconds the request may take before being cancelled
+    timeout_milliseconds int DEFAULT 5000,
+    -- name/json path pairs, when given only the values they extract from a json response body are stored
+    extract jsonb default null,
+    -- requests with the same key, url, headers and timeout are sent together as a json array body
+    aggregate_key text default null,
+    -- when the queue is full and pg_net.queue_full_policy is 'drop', lower priorities are dropped first
+    priority int default 0
+)
+    -- request_id reference
+    returns bigint
+    language plpgsql
+as $$
+declare
+    request_id bigint;
+    trace_parent text := net._traceparent();
+    content_type text;
+begin
+
+    -- Exctract the content_type from headers
+    select
+        header_value into content_type
+    from
+        jsonb_each_text(coalesce(headers, '{}'::jsonb)) r(header_name, header_value)
+    where
+        lower(header_name) = 'content-type'
+    limit
+        1;
+
+    -- If the user provided new headers and omitted the content type
+    -- add it back in automatically
+    if content_type is null then
+        select headers || '{"Content-Type": "application/json"}'::jsonb into headers;
+    end if;
+
+    -- Confirm that the content-type is set as "application/json"
+    if content_type <> 'application/json' then
+        raise exception 'Content-Type header must be "application/json"';
+    end if;
+
+    -- invalid json paths fail here instead of in the worker
+    perform value::jsonpath from jsonb_each_text(extract);
+
+    -- errors, waits or makes room when the queue is full, see pg_net.queue_full_policy
+    perform net._admit_request(priority);
+
+    -- Add to the request queue
+    insert into net.http_request_queue(method, url, headers, body, timeout_milliseconds, extract, traceparent, enqueued_at, aggregate_key, priority)
+    values (
+        'POST',
+        net._encode_url_with_params(url, params),
+        net._encode_headers(headers),
+        convert_to(body::text, 'UTF8'),
+        timeout_milliseconds,
+        extract,
+        trace_parent,
+        case when trace_parent is not null then clock_timestamp() end,
+        aggregate_key,
+        priority
+    )
+    returning id
+    into request_id;
+
+    perform net.wake();
+
+    return request_id;
+end
+$$;
+
+-- Interface to make an async request
+-- API: Public
+create or replace function net.http_delete(
+    -- url for the request
+    url text,
+    -- key/value pairs to be url encoded and appended to the `url`
+    params jsonb default '{}'::jsonb,
+    -- key/values to be included in request headers
+    headers jsonb default '{}'::jsonb,
+    -- the maximum number of milliseconds the request may take before being cancelled
+    timeout_milliseconds int default 5000,
+    -- optional body of the request
+    body jsonb default NULL,
+    -- name/json path pairs, when given only the values they extract from a json response body are stored
+    extract jsonb default null,
+    -- when the queue is full and pg_net.queue_full_policy is 'drop', lower priorities are dropped first
+    priority int default 0
+)
+    -- request_id reference
+    returns bigint
+    language plpgsql
+as $$
+declare
+    request_id bigint;
+    trace_parent text := net._traceparent();
+begin
+    -- invalid json paths fail here instead of in the worker
+    perform value::jsonpath from jsonb_each_text(extract);
+
+    -- errors, waits or makes room when the queue is full, see pg_net.queue_full_policy
+    perform net._admit_request(priority);
+
+    -- Add to the request queue
+    insert into net.http_request_queue(method, url, headers, body, timeout_milliseconds, extract, traceparent, enqueued_at, priority)
+    values (
+        'DELETE',
+        net._encode_url_with_params(url, params),
+        net._encode_headers(headers),
+        convert_to(body::text, 'UTF8'),
+        timeout_milliseconds,
+        extract,
+        trace_parent,
+        case when trace_parent is not null then clock_timestamp() end,
+        priority
+    )
+    returning id
+    into request_id;
+
+    perform net.wake();
+
+    return request_id;
+end
+$$;
+
+-- Runs a request inside the calling session, see net.http_request_sync
+-- API: Private
+create or replace function net._http_request_sync(
+    method text,
+    url text,
+    headers text[],
+    body bytea,
+    timeout_milliseconds int
+)
+    returns net.http_response
+    language 'c'
+as 'MODULE_PATHNAME';
+
+-- Interface to make a synchronous request, the calling session waits for the response. It doesn't
+-- go through the queue or the background worker
+-- API: Public
+create or replace function net.http_request_sync(
+    -- url for the request
+    url text,
+    -- GET, POST or DELETE
+    method net.http_method default 'GET',
+    -- key/value pairs to be url encoded and appended to the `url`
+    params jsonb default '{}'::jsonb,
+    -- key/values to be included in request headers
+    headers jsonb default '{}'::jsonb,
+    -- optional body of the request
+    body jsonb default null,
+    -- the maximum number of milliseconds the request may take before being cancelled
+    timeout_milliseconds int default 5000
+)
+    returns net.http_response
+    language plpgsql
+as $$
+begin
+    return net._http_request_sync(
+        method,
+        net._encode_url_with_params(url, params),
+        net._encode_headers(headers),
+        convert_to(body::text, 'UTF8'),
+        timeout_milliseconds
+    );
+end
+$$;
+
+-- Bodies bigger than pg_net.body_chunk_size, stored in order as they arrive
+-- API: Private
+create unlogged table net._http_response_chunk(
+    id bigint not null,
+    seq int not null,
+    data bytea not null,
+    primary key (id, seq)
+);
+
+grant all on net._http_response_chunk to PUBLIC;
+
+-- The body of a response as a sequence of chunks, either the ones stored while it arrived or a
+-- single one with its `content`
+-- API: Public
+create or replace function net.http_response_chunks(request_id bigint)
+    returns setof bytea
+    language sql
+    stable
+as $$
+    select data
+    from (
+        select seq, data from net._http_response_chunk where id = request_id
+        union all
+        select 0, convert_to(content, 'UTF8') from net._http_response where id = request_id and content is not null
+    ) chunks
+    order by seq
+$$;
+
+-- The whole body of a response, chunked or not
+-- API: Public
+create or replace function net.http_response_body(request_id bigint)
+    returns bytea
+    language sql
+    stable
+as $$
+    select string_agg(chunk, ''::bytea order by n)
+    from net.http_response_chunks(request_id) with ordinality as c(chunk, n)
+$$;
+
+-- Time spent by the worker in each phase of its loop, optionally resetting it after reading
+-- API: Public
+create or replace function net.worker_profile(reset bool default false)
+  returns table(phase text, calls bigint, total_ms float8, max_ms float8)
+  language 'c'
+  volatile
+as 'MODULE_PATHNAME';
+
+-- Stops the worker's transfers left without queue rows once the cancelling transaction commits
+-- API: Private
+create or replace function net._cancel_at_commit(cancelled bigint)
+  returns void
+  language 'c'
+as 'MODULE_PATHNAME';
+
+-- Cancels the requests that didn't get their response yet and returns their ids. Queued requests
+-- are removed from the queue, the transfers in flight are stopped once the transaction commits.
+-- Their response has the error_msg 'Request cancelled'.
+-- API: Public
+create or replace function net.cancel(request_ids bigint[])
+    returns setof bigint
+    language plpgsql
+as $$
+declare
+    cancelled bigint[];
+begin
+    with deleted as (
+        delete from net.http_request_queue where id = any(request_ids) returning id
+    ), responses as (
+        insert into net._http_response(id, timed_out, error_msg)
+        select id, false, 'Request cancelled' from deleted
+        returning id
+    )
+    select coalesce(array_agg(id), '{}') into cancelled from responses;
+
+    if cardinality(cancelled) > 0 then
+        perform net._cancel_at_commit(cardinality(cancelled));
+    end if;
+
+    return query select unnest(cancelled);
+end
+$$;
+
+-- Cancels a request that didn't get its response yet, false when it already got it
+-- API: Public
+create or replace function net.cancel(request_id bigint)
+    returns bool
+    language sql
+as $$
+    select exists (select 1 from net.cancel(array[request_id]));
+$$;
+
+-- The worker forgets the templates it cached once the transaction commits
+-- API: Private
+create or replace function net._request_templates_changed()
+  returns void
+  language 'c'
+as 'MODULE_PATHNAME';
+
+-- Stores a request template, replacing the one with the same name. Requests made with
+-- net.http_prepared(name, ...) take its method, url, headers, timeout and extract, so their queue
+-- rows only carry their params and body, and the worker builds the template's headers once.
+-- API: Public
+create or replace function net.prepare_request(
+    -- the name given to net.http_prepared, at most 63 bytes
+    name text,
+    -- GET, POST or DELETE
+    method net.http_method,
+    -- url of the requests, net.http_prepared appends its params to it
+    url text,
+    -- key/values to be included in request headers
+    headers jsonb default '{}'::jsonb,
+    -- the maximum number of milliseconds the requests may take before being cancelled
+    timeout_milliseconds int default 5000,
+    -- name/json path pairs, when given only the values they extract from a json response body are stored
+    extract jsonb default null
+)
+    returns void
+    language plpgsql
+as $$
+begin
+    -- invalid json paths fail here instead of in the worker
+    perform value::jsonpath from jsonb_each_text(prepare_request.extract);
+
+    insert into net._http_request_template(name, method, url, headers, timeout_milliseconds, extract)
+    values (
+        prepare_request.name,
+        prepare_request.method,
+        -- invalid urls fail here too
+        net._encode_url_with_params(prepare_request.url, '{}'),
+        net._encode_headers(prepare_request.headers),
+        prepare_request.timeout_milliseconds,
+        prepare_request.extract
+    )
+    on conflict on constraint _http_request_template_pkey do update set
+        method = excluded.method,
+        url = excluded.url,
+        headers = excluded.headers,
+        timeout_milliseconds = excluded.timeout_milliseconds,
+        extract = excluded.extract;
+
+    perform net._request_templates_changed();
+end
+$$;
+
+-- Removes a request template, the requests already made with it fail
+-- API: Public
+create or replace function net.drop_prepared_request(name text)
+    returns bool
+    language plpgsql
+as $$
+begin
+    delete from net._http_request_template t where t.name = drop_prepared_request.name;
+
+    if not found then
+        return false;
+    end if;
+
+    perform net._request_templates_changed();
+
+    return true;
+end
+$$;
+
+-- Interface to make an async request from a template, see net.prepare_request
+-- API: Public
+create or replace function net.http_prepared(
+    -- name of the template
+    name text,
+    -- key/value pairs to be url encoded and appended to the template's url
+    params jsonb default '{}'::jsonb,
+    -- optional body of the request
+    body jsonb default null,
+    -- when the queue is full and pg_net.queue_full_policy is 'drop', lower priorities are dropped first
+    priority int default 0
+)
+    -- request_id reference
+    returns bigint
+    language plpgsql
+as $$
+declare
+    request_id bigint;
+    tmpl net._http_request_template;
+    trace_parent text := net._traceparent();
+begin
+    select * into tmpl from net._http_request_template t where t.name = http_prepared.name;
+
+    if not found then
+        raise exception 'request template "%" doesn''t exist', http_prepared.name
+            using hint = 'Create it with net.prepare_request';
+    end if;
+
+    -- errors, waits or makes room when the queue is full, see pg_net.queue_full_policy
+    perform net._admit_request(priority);
+
+    -- Add to the request queue, the worker sends it with the template's method, url, headers,
+    -- timeout and extract as they are then
+    insert into net.http_request_queue(method, params, body, timeout_milliseconds, traceparent, enqueued_at, priority, template)
+    values (
+        tmpl.method,
+        nullif(net._encode_params(params), ''),
+        convert_to(body::text, 'UTF8'),
+        tmpl.timeout_milliseconds,
+        trace_parent,
+        case when trace_parent is not null then clock_timestamp() end,
+        priority,
+        tmpl.name
+    )
+    returning id
+    into request_id;
+
+    perform net.wake();
+
+    return request_id;
+end
+$$;
+
+-- Gives the recreated request functions the privileges granted or revoked on the old ones
+do $$
+declare
+    fn record;
+    acl record;
+begin
+    for fn in
+        select old.proacl, new::regprocedure as new_fn
+        from (values
+            ('net._http_get_0_20'::regproc, 'net.http_get'::regproc),
+            ('net._http_post_0_20'::regproc, 'net.http_post'::regproc),
+            ('net._http_delete_0_20'::regproc, 'net.http_delete'::regproc)
+        ) f(old_fn, new)
+        join pg_proc old on old.oid = f.old_fn
+        -- null when they were never changed from the default
+        where old.proacl is not null
+    loop
+        execute format('revoke all on function %s from public', fn.new_fn);
+
+        for acl in select * from aclexplode(fn.proacl) loop
+            execute format('grant %s on function %s to %s%s',
+                acl.privilege_type,
+                fn.new_fn,
+                case when acl.grantee = 0 then 'public' else acl.grantee::regrole::text end,
+                case when acl.is_grantable then ' with grant option' else '' end);
+        end loop;
+    end loop;
+end
+$$;
+
+drop function net._http_get_0_20;
+drop function net._http_post_0_20;
+drop function net._http_delete_0_20;
@@ -0,0 +1,386 @@
+#include "pg_prelude.h"
+
+#include "cache.h"
+
+// Responses are serialized into a chain of fixed size blocks, so entries of any size can share the
+// same memory without fragmenting it
+#define CACHE_BLOCK_DATA_SIZE 1020
+#define CACHE_TRANCHE_NAME "pg_net response cache"
+
+typedef struct {
+  int32 next; // -1 on the last block of a chain
+  char  data[CACHE_BLOCK_DATA_SIZE];
+} CacheBlock;
+
+// Keys of the index, different request keys can share one so their entries are chained
+typedef struct {
+  Oid    database; // entries are only served to the database that stored them
+  uint32 hash;     // hash of the request key
+} CacheBucketKey;
+
+typedef struct {
+  CacheBucketKey key; // must be the first field
+  int32          head_entry;
+} CacheBucket;
+
+typedef struct {
+  CacheBucketKey   bucket;
+  int32            key_len; // of the request key, the first field of the serialized response
+  int32            first_block;
+  int32            nblocks;
+  Size             len;
+  TimestampTz      expires_at;
+  int32            next_in_bucket; // or the next free entry
+  int32            lru_prev;       // towards the most recently listed entry
+  int32            lru_next;       // towards the least recently listed entry
+  uint64           listed_at;      // clock when put at the head of the LRU list
+  pg_atomic_uint64 last_used;      // clock of the last lookup, bumped under the shared lock
+} CacheEntry;
+
+typedef struct {
+  LWLock          *lock;
+  pg_atomic_uint64 clock;
+  int32            free_block; // head of the free list
+  int32            nfree;
+  int32            free_entry;
+  int32            lru_head; // the most recently listed entry
+  int32            lru_tail; // the next one to be evicted, unless it was used since it was listed
+  CacheBlock       blocks[FLEXIBLE_ARRAY_MEMBER];
+} ResponseCache;
+
+static ResponseCache *cache         = NULL;
+static CacheEntry    *cache_entries = NULL; // at most one per block
+static HTAB          *cache_index   = NULL;
+static int32          cache_blocks  = 0;
+
+static int32 blocks_for_size(int cache_size_kb) {
+  return (int32)(((Size)cache_size_kb * 1024) / sizeof(CacheBlock));
+}
+
+static Size blocks_size(int32 nblocks) {
+  return MAXALIGN(add_size(offsetof(ResponseCache, blocks), mul_size(sizeof(CacheBlock), nblocks)));
+}
+
+Size cache_shmem_size(int cache_size_kb) {
+  int32 nblocks = blocks_for_size(cache_size_kb);
+  if (nblocks == 0) return 0;
+
+  return add_size(add_size(blocks_size(nblocks), MAXALIGN(mul_size(sizeof(CacheEntry), nblocks))),
+                  hash_estimate_size(nblocks, sizeof(CacheBucket)));
+}
+
+// must be called where shared memory is requested, before the postmaster creates it
+void cache_shmem_request(int cache_size_kb) {
+  if (blocks_for_size(cache_size_kb) == 0) return;
+
+  RequestNamedLWLockTranche(CACHE_TRANCHE_NAME, 1);
+}
+
+void cache_shmem_init(int cache_size_kb) {
+  int32 nblocks = blocks_for_size(cache_size_kb);
+  if (nblocks == 0) return;
+
+  bool found;
+
+  cache = ShmemInitStruct("pg_net response cache", blocks_size(nblocks), &found);
+  cache_entries = ShmemInitStruct("pg_net response cache entries",
+                                  mul_size(sizeof(CacheEntry), nblocks), &found);
+
+  HASHCTL ctl = {
+    .keysize   = sizeof(CacheBucketKey),
+    .entrysize = sizeof(CacheBucket),
+  };
+  cache_index = ShmemInitHash("pg_net response cache index", nblocks, nblocks, &ctl,
+                              HASH_ELEM | HASH_BLOBS);
+  cache_blocks = nblocks;
+
+  if (!found) {
+    cache->lock = &(GetNamedLWLockTranche(CACHE_TRANCHE_NAME))->lock;
+    pg_atomic_init_u64(&cache->clock, 0);
+    cache->free_block = 0;
+    cache->nfree      = nblocks;
+    cache->free_entry = 0;
+    cache->lru_head   = -1;
+    cache->lru_tail   = -1;
+
+    for (int32 i = 0; i < nblocks; i++) {
+      cache->blocks[i].next = i + 1 < nblocks ? i + 1 : -1;
+
+      cache_entries[i].next_in_bucket = i + 1 < nblocks ? i + 1 : -1;
+      pg_atomic_init_u64(&cache_entries[i].last_used, 0);
+    }
+  }
+}
+
+static CacheBucketKey bucket_for_key(const char *key, int32 key_len) {
+  return (CacheBucketKey){
+    .database = MyDatabaseId,
+    .hash     = DatumGetUInt32(hash_any((const unsigned char *)key, key_len)),
+  };
+}
+
+// compares the request key with the one serialized at the start of the entry's blocks
+static bool entry_has_key(const CacheEntry *entry, const char *key, int32 key_len) {
+  if (entry->key_len != key_len) return false;
+
+  Size  offset = sizeof(int32); // the length of the key field
+  int32 b      = entry->first_block;
+
+  for (int32 compared = 0; compared < key_len;) {
+    while (offset >= CACHE_BLOCK_DATA_SIZE) {
+      b = cache->blocks[b].next;
+      offset -= CACHE_BLOCK_DATA_SIZE;
+    }
+
+    int32 chunk = Min(key_len - compared, (int32)(CACHE_BLOCK_DATA_SIZE - offset));
+    if (memcmp(cache->blocks[b].data + offset, key + compared, chunk) != 0) return false;
+
+    compared += chunk;
+    offset += chunk;
+  }
+
+  return true;
+}
+
+// the lock must be held
+static int32 find_entry(const CacheBucketKey *bucket_key, const char *key, int32 key_len) {
+  CacheBucket *bucket = hash_search(cache_index, bucket_key, HASH_FIND, NULL);
+  if (bucket == NULL) return -1;
+
+  for (int32 e = bucket->head_entry; e >= 0; e = cache_entries[e].next_in_bucket) {
+    if (entry_has_key(&cache_entries[e], key, key_len)) return e;
+  }
+
+  return -1;
+}
+
+static void lru_push_head(int32 e) {
+  CacheEntry *entry = &cache_entries[e];
+
+  entry->lru_prev  = -1;
+  entry->lru_next  = cache->lru_head;
+  entry->listed_at = pg_atomic_fetch_add_u64(&cache->clock, 1) + 1;
+
+  if (cache->lru_head >= 0) cache_entries[cache->lru_head].lru_prev = e;
+  cache->lru_head = e;
+  if (cache->lru_tail < 0) cache->lru_tail = e;
+}
+
+static void lru_unlink(int32 e) {
+  CacheEntry *entry = &cache_entries[e];
+
+  if (entry->lru_prev >= 0)
+    cache_entries[entry->lru_prev].lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+
+  if (entry->lru_next >= 0)
+    cache_entries[entry->lru_next].lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+}
+
+static void free_blocks(CacheEntry *entry) {
+  int32 last = entry->first_block;
+  while (cache->blocks[last].next >= 0)
+    last = cache->blocks[last].next;
+
+  cache->blocks[last].next = cache->free_block;
+  cache->free_block        = entry->first_block;
+  cache->nfree += entry->nblocks;
+}
+
+static void remove_entry(int32 e) {
+  CacheEntry  *entry  = &cache_entries[e];
+  CacheBucket *bucket = hash_search(cache_index, &entry->bucket, HASH_FIND, NULL);
+
+  if (bucket->head_entry == e) {
+    bucket->head_entry = entry->next_in_bucket;
+  } else {
+    int32 prev = bucket->head_entry;
+    while (cache_entries[prev].next_in_bucket != e)
+      prev = cache_entries[prev].next_in_bucket;
+    cache_entries[prev].next_in_bucket = entry->next_in_bucket;
+  }
+
+  if (bucket->head_entry < 0) hash_search(cache_index, &entry->bucket, HASH_REMOVE, NULL);
+
+  lru_unlink(e);
+  free_blocks(entry);
+
+  entry->next_in_bucket = cache->free_entry;
+  cache->free_entry     = e;
+}
+
+// Lookups only bump last_used, since they hold the shared lock. So the tail of the LRU list gets a
+// second chance at the head when it was used since it was listed, which keeps eviction O(1)
+// amortized instead of scanning every entry.
+static void evict_least_recently_used(void) {
+  while (cache->lru_tail >= 0) {
+    int32       e     = cache->lru_tail;
+    CacheEntry *entry = &cache_entries[e];
+
+    if (pg_atomic_read_u64(&entry->last_used) <= entry->listed_at) {
+      remove_entry(e);
+      return;
+    }
+
+    lru_unlink(e);
+    lru_push_head(e);
+  }
+}
+
+static void append_field(StringInfo buf, const char *data, int32 len) {
+  appendBinaryStringInfo(buf, (const char *)&len, sizeof(int32));
+  if (len > 0) appendBinaryStringInfo(buf, data, len);
+}
+
+static void append_cstring_field(StringInfo buf, const char *str) {
+  append_field(buf, str, str ? (int32)strlen(str) : -1);
+}
+
+// returns a palloc'd, NUL terminated copy of the field or NULL, advancing the cursor past it
+static char *read_field(const char **cursor, int32 *len) {
+  memcpy(len, *cursor, sizeof(int32));
+  *cursor += sizeof(int32);
+
+  if (*len < 0) return NULL;
+
+  char *field = palloc(*len + 1);
+  memcpy(field, *cursor, *len);
+  field[*len] = '\0';
+  *cursor += *len;
+
+  return field;
+}
+
+// Returns the cached response for the request key, as stored by a worker of the same database. A
+// response that's no longer fresh is still returned so it can be revalidated with its ETag or
+// Last-Modified.
+bool cache_lookup(const char *key, CachedResponse *out) {
+  if (cache == NULL) return false;
+
+  int32          key_len    = (int32)strlen(key);
+  CacheBucketKey bucket_key = bucket_for_key(key, key_len);
+  char          *data       = NULL;
+  TimestampTz    expires_at = 0;
+
+  LWLockAcquire(cache->lock, LW_SHARED);
+
+  int32 e = find_entry(&bucket_key, key, key_len);
+
+  if (e >= 0) {
+    CacheEntry *entry = &cache_entries[e];
+
+    data = palloc(entry->len);
+
+    Size copied = 0;
+    for (int32 b = entry->first_block; b >= 0; b = cache->blocks[b].next) {
+      Size chunk = Min(entry->len - copied, CACHE_BLOCK_DATA_SIZE);
+      memcpy(data + copied, cache->blocks[b].data, chunk);
+      copied += chunk;
+    }
+
+    pg_atomic_write_u64(&entry->last_used, pg_atomic_fetch_add_u64(&cache->clock, 1) + 1);
+    expires_at = entry->expires_at;
+  }
+
+  LWLockRelease(cache->lock);
+
+  if (data == NULL) return false;
+
+  const char *cursor = data;
+  int32       len;
+
+  // the key was compared in place
+  cursor += sizeof(int32) + key_len;
+
+  memcpy(&out->status_code, cursor, sizeof(int32));
+  cursor += sizeof(int32);
+
+  out->content_type  = read_field(&cursor, &len);
+  out->etag          = read_field(&cursor, &len);
+  out->last_modified = read_field(&cursor, &len);
+  out->headers       = (Jsonb *)read_field(&cursor, &len);
+  out->body          = read_field(&cursor, &len);
+  out->fresh         = GetCurrentTimestamp() < expires_at;
+
+  pfree(data);
+
+  return true;
+}
+
+// Stores the response under the request key, replacing any previous one. Least recently used
+// entries are evicted to make room. A response bigger than a quarter of the cache isn't stored.
+void cache_store(const char *key, const CachedResponse *response, TimestampTz expires_at) {
+  if (cache == NULL) return;
+
+  StringInfoData buf;
+  initStringInfo(&buf);
+
+  append_cstring_field(&buf, key);
+  appendBinaryStringInfo(&buf, (const char *)&response->status_code, sizeof(int32));
+  append_cstring_field(&buf, response->content_type);
+  append_cstring_field(&buf, response->etag);
+  append_cstring_field(&buf, response->last_modified);
+  append_field(&buf, (const char *)response->headers, VARSIZE(response->headers));
+  append_cstring_field(&buf, response->body);
+
+  int32 needed = (buf.len + CACHE_BLOCK_DATA_SIZE - 1) / CACHE_BLOCK_DATA_SIZE;
+
+  if (needed > cache_blocks / 4) {
+    pfree(buf.data);
+    return;
+  }
+
+  int32          key_len    = (int32)strlen(key);
+  CacheBucketKey bucket_key = bucket_for_key(key, key_len);
+
+  LWLockAcquire(cache->lock, LW_EXCLUSIVE);
+
+  int32 e = find_entry(&bucket_key, key, key_len);
+  if (e >= 0) remove_entry(e);
+
+  while (cache->nfree < needed)
+    evict_least_recently_used();
+
+  // there's at most one entry and one bucket per block, so neither can run out at this point
+  bool         found;
+  CacheBucket *bucket = hash_search(cache_index, &bucket_key, HASH_ENTER_NULL, &found);
+
+  if (bucket) {
+    if (!found) bucket->head_entry = -1;
+
+    e                 = cache->free_entry;
+    CacheEntry *entry = &cache_entries[e];
+    cache->free_entry = entry->next_in_bucket;
+
+    entry->bucket         = bucket_key;
+    entry->key_len        = key_len;
+    entry->first_block    = cache->free_block;
+    entry->nblocks        = needed;
+    entry->len            = buf.len;
+    entry->expires_at     = expires_at;
+    entry->next_in_bucket = bucket->head_entry;
+    bucket->head_entry    = e;
+    pg_atomic_write_u64(&entry->last_used, 0);
+    lru_push_head(e);
+
+    Size  copied = 0;
+    int32 last   = -1;
+    for (int32 b = cache->free_block; copied < (Size)buf.len; b = cache->blocks[b].next) {
+      Size chunk = Min((Size)buf.len - copied, CACHE_BLOCK_DATA_SIZE);
+      memcpy(cache->blocks[b].data, buf.data + copied, chunk);
+      copied += chunk;
+      last = b;
+    }
+
+    cache->free_block        = cache->blocks[last].next;
+    cache->blocks[last].next = -1;
+    cache->nfree -= needed;
+  }
+
+  LWLockRelease(cache->lock);
+
+  pfree(buf.data);
+}
@@ -0,0 +1,25 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+// A response kept in the shared response cache
+typedef struct {
+  int32  status_code;
+  char  *content_type;  // NULL when the response had none
+  char  *etag;          // NULL when the response had none
+  char  *last_modified; // NULL when the response had none
+  Jsonb *headers;
+  char  *body;  // NULL when the response body was empty
+  bool   fresh; // false when it must be revalidated before being used
+} CachedResponse;
+
+Size cache_shmem_size(int cache_size_kb);
+
+void cache_shmem_request(int cache_size_kb);
+
+void cache_shmem_init(int cache_size_kb);
+
+bool cache_lookup(const char *key, CachedResponse *out);
+
+void cache_store(const char *key, const CachedResponse *response, TimestampTz expires_at);
+
+#endif
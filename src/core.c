@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <string.h>
@@ -11,17 +12,204 @@
 #include "errors.h"
 #include "event.h"
 
-static SPIPlanPtr del_response_plan     = NULL;
-static SPIPlanPtr del_return_queue_plan = NULL;
-static SPIPlanPtr ins_response_plan     = NULL;
+static SPIPlanPtr del_response_plan = NULL;
+static SPIPlanPtr drop_queue_plan   = NULL;
+static SPIPlanPtr sel_queue_plan    = NULL;
+static SPIPlanPtr ins_response_plan = NULL;
+static SPIPlanPtr ins_chunk_plan    = NULL;
+static SPIPlanPtr del_chunks_plan   = NULL;
+static SPIPlanPtr ins_span_plan     = NULL;
+static SPIPlanPtr sel_queued_plan   = NULL;
+static SPIPlanPtr sel_template_plan = NULL;
+static SPIPlanPtr extract_plan      = NULL;
+static SPIPlanPtr extract_each_plan = NULL;
+
+enum { response_nparams = 9 }; // the parameters of the insert done by insert_response_values
+
+// requests whose response was inserted, see pop_completed_requests
+static uint64 completed_requests = 0;
+
+// the responses with json paths to extract, in TopTransactionContext until extract_json_responses
+static Datum *extract_ids      = NULL;
+static Datum *extract_specs    = NULL;
+static int    nextract         = 0;
+static int    extract_capacity = 0;
+
+// see set_body_chunk_size, the transfers waiting for their chunk to be written are paused
+static int   body_chunk_size = 0;
+static List *paused_handles  = NIL;
+
+// net.http_request_sync transfers run on this multi handle, it's kept between calls so their
+// connections are reused
+static CURLM     *sync_mhandle      = NULL;
+static CurlHandle sync_handle       = {0};
+static bool       sync_handle_added = false;
+static const int  sync_poll_ms      = 100;
+
+typedef struct {
+  char *host;
+  char *path;
+} UnixSocketRoute;
+
+// parsed from pg_net.proxy and pg_net.unix_sockets, see set_transport_config
+static char *proxy        = NULL;
+static List *unix_sockets = NIL;
+
+// the hosts with consecutive connection failures, see reject_by_circuit_breaker
+typedef struct {
+  char        host[256]; // host:port, must be the first field
+  int         failures;
+  TimestampTz open_until; // requests to the host fail fast until then
+} HostCircuit;
+
+static HTAB *host_circuits            = NULL;
+static int   circuit_breaker_failures = 0;
+static int   circuit_breaker_cooldown = 0;
+
+// the concurrency learned for each host, see defer_by_concurrency_limit
+typedef struct {
+  char   host[256]; // host:port, must be the first field
+  double limit;
+  int    in_flight;
+  double latency_ms;  // smoothed latency of the responses
+  double baseline_ms; // the lowest recent latency, 0 until the first response
+  bool   decreased;   // the limit was already cut in the current batch
+} HostLimit;
+
+static HTAB  *host_limits         = NULL;
+static int    concurrency_ceiling = 0;
+static double global_limit        = 0;
+static int    batch_responses     = 0;
+static int    batch_overloads     = 0;
+
+// a host is overloaded when its smoothed latency is this many times its baseline, and higher by at
+// least min_latency_increase_ms so the jitter of fast hosts doesn't count
+static const double latency_tolerance       = 2.0;
+static const double min_latency_increase_ms = 10.0;
+// how much the baseline rises per response slower than it, so a single fast outlier doesn't stick
+static const double baseline_drift = 1.01;
+
+// see aggregate_request
+static int aggregate_max_requests = 0;
+static int aggregate_max_size     = 0;
 
 static size_t body_cb(void *contents, size_t size, size_t nmemb, void *userp) {
   CurlHandle *handle   = (CurlHandle *)userp;
   size_t      realsize = size * nmemb;
+
+  // A full chunk can't be written from here, an error would jump out of libcurl. The transfer is
+  // paused instead, until resume_paused_transfers writes the chunk once libcurl returns.
+  if (body_chunk_size > 0 && handle->body->len > 0 &&
+      handle->body->len + realsize > (size_t)body_chunk_size) {
+    if (!handle->paused) {
+      paused_handles = lappend(paused_handles, handle);
+      handle->paused = true;
+    }
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
   appendBinaryStringInfo(handle->body, (const char *)contents, (int)realsize);
   return realsize;
 }
 
+// Bodies bigger than pg_net.body_chunk_size are written to net._http_response_chunk as they arrive,
+// so the memory used by a transfer stays bounded
+void set_body_chunk_size(int chunk_size_kb) {
+  body_chunk_size = chunk_size_kb * 1024;
+}
+
+void write_body_chunk(CurlHandle *handle) {
+  if (ins_chunk_plan == NULL) {
+    SPIPlanPtr tmp = SPI_prepare(
+        "insert into net._http_response_chunk(id, seq, data) values ($1, $2, $3)", 3,
+        (Oid[]){INT8OID, INT4OID, BYTEAOID});
+
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
+
+    ins_chunk_plan = SPI_saveplan(tmp);
+    if (ins_chunk_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+
+    SPI_freeplan(tmp);
+  }
+
+  if (del_chunks_plan == NULL) {
+    SPIPlanPtr tmp =
+        SPI_prepare("delete from net._http_response_chunk where id = $1", 1, (Oid[]){INT8OID});
+
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
+
+    del_chunks_plan = SPI_saveplan(tmp);
+    if (del_chunks_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+
+    SPI_freeplan(tmp);
+  }
+
+  // a single write from libcurl can be bigger than a chunk, the body is split so no chunk is bigger
+  // than pg_net.body_chunk_size
+  int piece_size = body_chunk_size > 0 ? body_chunk_size : handle->body->len;
+
+  for (int offset = 0; offset < handle->body->len; offset += piece_size) {
+    int    len  = Min(handle->body->len - offset, piece_size);
+    bytea *data = palloc(VARHDRSZ + len);
+    SET_VARSIZE(data, VARHDRSZ + len);
+    memcpy(VARDATA(data), handle->body->data + offset, len);
+
+    // the requests coalesced into this one get the same chunks
+    for (int i = -1; i < handle->ncoalesced; i++) {
+      int64 id = i < 0 ? handle->id : handle->coalesced_ids[i];
+
+      // the chunks committed by an attempt interrupted by an error, the request is being sent again
+      if (handle->nchunks == 0) {
+        int ret_code =
+            SPI_execute_plan(del_chunks_plan, (Datum[]){Int64GetDatum(id)}, NULL, false, 0);
+
+        if (ret_code != SPI_OK_DELETE)
+          ereport(ERROR, errmsg("Error when deleting response body chunks: %s",
+                                SPI_result_code_string(ret_code)));
+      }
+
+      int ret_code = SPI_execute_plan(
+          ins_chunk_plan,
+          (Datum[]){Int64GetDatum(id), Int32GetDatum(handle->nchunks), PointerGetDatum(data)},
+          NULL, false, 0);
+
+      if (ret_code != SPI_OK_INSERT)
+        ereport(ERROR, errmsg("Error when inserting response body chunk: %s",
+                              SPI_result_code_string(ret_code)));
+    }
+
+    pfree(data);
+    handle->nchunks++;
+  }
+
+  resetStringInfo(handle->body);
+}
+
+// Writes the full body chunks of the paused transfers and resumes them
+void resume_paused_transfers(void) {
+  while (paused_handles != NIL) {
+    List *handles  = paused_handles;
+    paused_handles = NIL;
+
+    ListCell *lc;
+    foreach (lc, handles) {
+      CurlHandle *handle = (CurlHandle *)lfirst(lc);
+
+      write_body_chunk(handle);
+      handle->paused = false;
+
+      // resuming delivers the data libcurl kept, which can pause the transfer again
+      if (curl_easy_pause(handle->ez_handle, CURLPAUSE_CONT) != CURLE_OK)
+        ereport(ERROR,
+                errmsg("Could not resume the transfer of request " INT64_FORMAT, handle->id));
+    }
+
+    list_free(handles);
+  }
+}
+
 static struct curl_slist *pg_text_array_to_slist(ArrayType *array, struct curl_slist *headers) {
   ArrayIterator iterator;
   Datum         value;
@@ -44,22 +232,455 @@ static struct curl_slist *pg_text_array_to_slist(ArrayType *array, struct curl_s
   return headers;
 }
 
+// Parses the transport settings, unix_sockets is a comma separated list of `host=/path/to/socket`
+void set_transport_config(const char *proxy_url, const char *unix_socket_routes) {
+  MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
+
+  if (proxy) pfree(proxy);
+  proxy = proxy_url[0] != '\0' ? pstrdup(proxy_url) : NULL;
+
+  ListCell *lc;
+  foreach (lc, unix_sockets) {
+    UnixSocketRoute *usr = (UnixSocketRoute *)lfirst(lc);
+    pfree(usr->host);
+    pfree(usr->path);
+  }
+  list_free_deep(unix_sockets);
+  unix_sockets = NIL;
+
+  char *raw_routes = pstrdup(unix_socket_routes);
+  List *routes     = NIL;
+
+  if (!SplitGUCList(raw_routes, ',', &routes))
+    ereport(WARNING, errmsg("invalid list syntax in pg_net.unix_sockets"));
+
+  foreach (lc, routes) {
+    char *route = (char *)lfirst(lc);
+    char *sep   = strchr(route, '=');
+
+    if (sep == NULL || sep == route || sep[1] == '\0') {
+      ereport(WARNING, errmsg("invalid route \"%s\" in pg_net.unix_sockets, it must be of the form "
+                              "host=/path/to/socket",
+                              route));
+      continue;
+    }
+
+    UnixSocketRoute *usr = palloc(sizeof(UnixSocketRoute));
+    usr->host            = pnstrdup(route, sep - route);
+    usr->path            = pstrdup(sep + 1);
+    unix_sockets         = lappend(unix_sockets, usr);
+  }
+
+  list_free(routes);
+  pfree(raw_routes);
+
+  MemoryContextSwitchTo(old_context);
+}
+
+// returns the palloc'd host of the url, as host:port when with_port, NULL when the url is invalid
+static char *url_host(const char *url, bool with_port) {
+  char  *host   = NULL;
+  char  *port   = NULL;
+  char  *result = NULL;
+  CURLU *h      = curl_url();
+
+  // an invalid url is reported by the transfer itself
+  if (curl_url_set(h, CURLUPART_URL, url, 0) == CURLUE_OK &&
+      curl_url_get(h, CURLUPART_HOST, &host, 0) == CURLUE_OK) {
+    if (!with_port)
+      result = pstrdup(host);
+    else if (curl_url_get(h, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK) {
+      result = psprintf("%s:%s", host, port);
+      curl_free(port);
+    }
+    curl_free(host);
+  }
+
+  curl_url_cleanup(h);
+  return result;
+}
+
+static const char *unix_socket_for_url(const char *url) {
+  if (unix_sockets == NIL) return NULL;
+
+  const char *path = NULL;
+  char       *host = url_host(url, false);
+
+  if (host) {
+    ListCell *lc;
+    foreach (lc, unix_sockets) {
+      UnixSocketRoute *usr = (UnixSocketRoute *)lfirst(lc);
+      if (pg_strcasecmp(usr->host, host) == 0) {
+        path = usr->path;
+        break;
+      }
+    }
+    pfree(host);
+  }
+
+  return path;
+}
+
+// Routes a request through its pg_net.unix_sockets path or else through pg_net.proxy, the same way
+// for requests and warm handles so warmed connections are the ones the requests reuse
+static void set_curl_transport(CURL *ez_handle, const char *url) {
+  const char *unix_socket = unix_socket_for_url(url);
+  if (unix_socket)
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_UNIX_SOCKET_PATH, unix_socket);
+  else if (proxy)
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_PROXY, proxy);
+}
+
+// A failures of 0 disables the circuit breaker. The state of the hosts is reset.
+void set_circuit_breaker_config(int failures, int cooldown_ms) {
+  circuit_breaker_failures = failures;
+  circuit_breaker_cooldown = cooldown_ms;
+
+  if (host_circuits) hash_destroy(host_circuits);
+  host_circuits = NULL;
+
+  if (failures == 0) return;
+
+  HASHCTL ctl = {
+    .keysize   = sizeof(((HostCircuit *)0)->host),
+    .entrysize = sizeof(HostCircuit),
+    .hcxt      = TopMemoryContext,
+  };
+  host_circuits = hash_create("pg_net host circuits", 64, &ctl,
+                              HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+}
+
+// only failures to reach the host count, any response means it's up
+static bool is_connection_failure(CURLcode curl_return_code) {
+  return curl_return_code == CURLE_COULDNT_RESOLVE_HOST ||
+         curl_return_code == CURLE_COULDNT_CONNECT ||
+         curl_return_code == CURLE_OPERATION_TIMEDOUT;
+}
+
+static void record_circuit_outcome(const char *host, CURLcode curl_return_code) {
+  if (!is_connection_failure(curl_return_code)) {
+    hash_search(host_circuits, host, HASH_REMOVE, NULL);
+    return;
+  }
+
+  bool         found;
+  HostCircuit *circuit = hash_search(host_circuits, host, HASH_ENTER, &found);
+
+  if (!found) {
+    circuit->failures   = 0;
+    circuit->open_until = 0;
+  }
+
+  // a failed probe opens the circuit again
+  if (++circuit->failures >= circuit_breaker_failures)
+    circuit->open_until =
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(), circuit_breaker_cooldown);
+}
+
+// When enabled, the number of requests in flight, per host and in total, adapts to the latency and
+// errors of their responses: it grows additively while they're fine and is halved on overload, up
+// to the ceiling of pg_net.batch_size. The learned limits are reset.
+void set_adaptive_concurrency(bool enabled, int ceiling) {
+  if (host_limits) hash_destroy(host_limits);
+  host_limits = NULL;
+
+  concurrency_ceiling = ceiling;
+  global_limit        = ceiling;
+  batch_responses     = 0;
+  batch_overloads     = 0;
+
+  if (!enabled) return;
+
+  HASHCTL ctl = {
+    .keysize   = sizeof(((HostLimit *)0)->host),
+    .entrysize = sizeof(HostLimit),
+    .hcxt      = TopMemoryContext,
+  };
+  host_limits = hash_create("pg_net host concurrency limits", 64, &ctl,
+                            HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+}
+
+// the number of requests read for the next batch
+int concurrency_batch_size(int batch_size) {
+  if (host_limits == NULL) return batch_size;
+
+  return Max(1, (int)global_limit);
+}
+
+// the limits grow by a twentieth of the ceiling per batch, so they recover from a cut in a few
+static double concurrency_increase(void) {
+  return Max(1.0, concurrency_ceiling / 20.0);
+}
+
+// Returns true when the row's host already has as many requests in flight as its limit allows, the
+// row is then left in the queue for a later batch.
+bool defer_by_concurrency_limit(RequestQueueRow row, CurlHandle *handle) {
+  handle->limit_host = NULL;
+
+  if (host_limits == NULL) return false;
+
+  char *url  = TextDatumGetCString(row.url);
+  char *host = url_host(url, true);
+  pfree(url);
+
+  if (host == NULL) return false;
+
+  bool       found;
+  HostLimit *limit = hash_search(host_limits, host, HASH_ENTER, &found);
+
+  if (!found) {
+    limit->limit       = concurrency_ceiling;
+    limit->in_flight   = 0;
+    limit->latency_ms  = 0;
+    limit->baseline_ms = 0;
+    limit->decreased   = false;
+  }
+
+  if (limit->in_flight >= Max(1, (int)limit->limit)) {
+    pfree(host);
+    return true;
+  }
+
+  limit->in_flight++;
+  handle->limit_host = host;
+  return false;
+}
+
+static void record_concurrency_outcome(CurlHandle *handle, CURLcode curl_return_code) {
+  HostLimit *limit = hash_search(host_limits, handle->limit_host, HASH_FIND, NULL);
+  if (limit == NULL) return;
+
+  curl_off_t total_us    = 0;
+  long       status_code = 0;
+  EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_TOTAL_TIME_T, &total_us);
+  EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_RESPONSE_CODE, &status_code);
+
+  double latency_ms = total_us / 1000.0;
+  bool   overloaded = curl_return_code == CURLE_OPERATION_TIMEDOUT ||
+                    curl_return_code == CURLE_COULDNT_CONNECT || status_code == 429 ||
+                    status_code == 503;
+
+  if (curl_return_code == CURLE_OK) {
+    limit->latency_ms =
+        limit->latency_ms == 0 ? latency_ms : 0.8 * limit->latency_ms + 0.2 * latency_ms;
+    limit->baseline_ms = limit->baseline_ms == 0
+                             ? latency_ms
+                             : Min(latency_ms, limit->baseline_ms * baseline_drift);
+
+    overloaded = overloaded || (limit->latency_ms > limit->baseline_ms * latency_tolerance &&
+                                limit->latency_ms - limit->baseline_ms > min_latency_increase_ms);
+  }
+
+  batch_responses++;
+
+  if (overloaded) {
+    batch_overloads++;
+
+    // the responses of a batch arrive together, one cut per batch is enough
+    if (!limit->decreased) {
+      limit->limit     = Max(1.0, limit->limit / 2);
+      limit->decreased = true;
+    }
+  } else {
+    limit->limit = Min(concurrency_ceiling, limit->limit + concurrency_increase() / limit->limit);
+  }
+}
+
+// Called once the transfers of a batch are done. The global limit is halved when more than a tenth
+// of the responses showed overload and grows otherwise. Idle hosts back at the ceiling are
+// forgotten.
+void adapt_concurrency_limits(void) {
+  if (host_limits == NULL) return;
+
+  if (batch_responses > 0) {
+    global_limit = batch_overloads * 10 > batch_responses
+                       ? Max(1.0, global_limit / 2)
+                       : Min(concurrency_ceiling, global_limit + concurrency_increase());
+
+    elog(DEBUG1, "pg_net concurrency limit: %d, %d of %d responses overloaded", (int)global_limit,
+         batch_overloads, batch_responses);
+  }
+
+  batch_responses = 0;
+  batch_overloads = 0;
+
+  HASH_SEQ_STATUS status;
+  HostLimit      *limit;
+
+  hash_seq_init(&status, host_limits);
+  while ((limit = hash_seq_search(&status)) != NULL) {
+    if (limit->in_flight == 0 && limit->limit >= concurrency_ceiling) {
+      hash_search(host_limits, limit->host, HASH_REMOVE, NULL);
+      continue;
+    }
+
+    limit->in_flight = 0;
+    limit->decreased = false;
+  }
+}
+
+static void set_curl_protocols(CURL *ez_handle) {
+#if LIBCURL_VERSION_NUM >= 0x075500 /* libcurl 7.85.0 */
+  EREPORT_CURL_SETOPT(ez_handle, CURLOPT_PROTOCOLS_STR, "http,https");
+#else
+  EREPORT_CURL_SETOPT(ez_handle, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+#endif
+}
+
+static void random_hex(char *dst, int nbytes) {
+  uint8 buf[16];
+
+  if (!pg_strong_random(buf, nbytes)) ereport(ERROR, errmsg("could not generate a random span id"));
+
+  hex_encode((const char *)buf, nbytes, dst);
+  dst[nbytes * 2] = '\0';
+}
+
+static bool is_hex_id(const char *str, int len) {
+  bool all_zeros = true;
+
+  for (int i = 0; i < len; i++) {
+    if (!isxdigit((unsigned char)str[i])) return false;
+    if (str[i] != '0') all_zeros = false;
+  }
+
+  // an id of all zeros is invalid
+  return !all_zeros;
+}
+
+// version-trace_id-parent_id-flags, see https://www.w3.org/TR/trace-context/#traceparent-header
+static bool is_traceparent(const char *value) {
+  return strlen(value) == 55 && value[2] == '-' && value[35] == '-' && value[52] == '-' &&
+         is_hex_id(value + 3, 32) && is_hex_id(value + 36, 16) &&
+         isxdigit((unsigned char)value[53]) && isxdigit((unsigned char)value[54]);
+}
+
+// the value of the traceparent header among the request's headers, NULL when there's none
+static char *traceparent_header(RequestQueueRow row) {
+  if (row.headersBin.isnull) return NULL;
+
+  ArrayIterator iterator = array_create_iterator(DatumGetArrayTypeP(row.headersBin.value), 0, NULL);
+  Datum         value;
+  bool          isnull;
+  char         *header = NULL;
+
+  while (header == NULL && array_iterate(iterator, &value, &isnull)) {
+    if (isnull) continue;
+
+    char *line = TextDatumGetCString(value);
+
+    if (pg_strncasecmp(line, "traceparent:", 12) == 0) {
+      char *start = line + 12;
+      while (isspace((unsigned char)*start))
+        start++;
+      header = pstrdup(start);
+    }
+    pfree(line);
+  }
+  array_free_iterator(iterator);
+
+  return header;
+}
+
+// The request gets a new span id. It inherits the trace id of the caller's traceparent when it's a
+// valid one, otherwise it starts a new trace. A request with its own traceparent header keeps it,
+// its span is then the one the header names.
+static RequestTrace *start_trace(RequestQueueRow row) {
+  RequestTrace *trace      = palloc0(sizeof(RequestTrace));
+  char         *parent     = TextDatumGetCString(row.traceparentBin.value);
+  char         *header     = traceparent_header(row);
+  bool          has_parent = is_traceparent(parent);
+
+  if (has_parent) {
+    memcpy(trace->trace_id, parent + 3, 32);
+    memcpy(trace->parent_span_id, parent + 36, 16);
+    memcpy(trace->flags, parent + 53, 2);
+  } else {
+    random_hex(trace->trace_id, 16);
+    strcpy(trace->flags, "01"); // sampled
+  }
+
+  if (header && is_traceparent(header)) {
+    // the caller's span is only its parent when they're in the same trace
+    if (!has_parent || memcmp(parent + 3, header + 3, 32) != 0) trace->parent_span_id[0] = '\0';
+
+    memcpy(trace->trace_id, header + 3, 32);
+    memcpy(trace->span_id, header + 36, 16);
+    memcpy(trace->flags, header + 53, 2);
+  } else {
+    random_hex(trace->span_id, 8);
+  }
+
+  trace->user_header = header != NULL;
+
+  pfree(parent);
+  if (header) pfree(header);
+
+  trace->dequeued_at = GetCurrentTimestamp();
+  trace->enqueued_at = !row.enqueuedAtBin.isnull ? DatumGetTimestampTz(row.enqueuedAtBin.value)
+                                                 : trace->dequeued_at;
+  return trace;
+}
+
 void init_curl_handle(CurlHandle *handle, RequestQueueRow row) {
-  handle->id        = row.id;
-  handle->body      = makeStringInfo();
-  handle->ez_handle = curl_easy_init();
+  handle->id   = row.id;
+  handle->ctid = row.ctid;
+  handle->body = makeStringInfo();
+
+  // the easy handle is kept between batches, resetting it keeps its DNS and TLS session caches
+  if (handle->ez_handle)
+    curl_easy_reset(handle->ez_handle);
+  else
+    handle->ez_handle = curl_easy_init();
+
+  if (!handle->ez_handle) ereport(ERROR, errmsg("curl_easy_init()"));
 
   handle->timeout_milliseconds = row.timeout_milliseconds;
 
-  if (!row.headersBin.isnull) {
-    ArrayType         *pgHeaders       = DatumGetArrayTypeP(row.headersBin.value);
-    struct curl_slist *request_headers = NULL;
+  // headers come already encoded as `Name: value` lines from the queue, see net._encode_headers
+  struct curl_slist *request_headers = NULL;
+
+  // the headers of a template are built once, see resolve_request_template
+  if (!row.headersBin.isnull && row.template == NULL) {
+    ArrayType *pgHeaders = DatumGetArrayTypeP(row.headersBin.value);
 
     request_headers = pg_text_array_to_slist(pgHeaders, request_headers);
+  }
+
+  // revalidate the stale cached response, a 304 means it can still be used
+  if (handle->cached && handle->cached->etag) {
+    char *if_none_match = psprintf("If-None-Match: %s", handle->cached->etag);
+    EREPORT_CURL_SLIST_APPEND(request_headers, if_none_match);
+    pfree(if_none_match);
+  } else if (handle->cached && handle->cached->last_modified) {
+    char *if_modified_since = psprintf("If-Modified-Since: %s", handle->cached->last_modified);
+    EREPORT_CURL_SLIST_APPEND(request_headers, if_modified_since);
+    pfree(if_modified_since);
+  }
+
+  handle->trace = !row.traceparentBin.isnull ? start_trace(row) : NULL;
+
+  if (handle->trace && !handle->trace->user_header) {
+    char *traceparent = psprintf("traceparent: 00-%s-%s-%s", handle->trace->trace_id,
+                                 handle->trace->span_id, handle->trace->flags);
+    EREPORT_CURL_SLIST_APPEND(request_headers, traceparent);
+    pfree(traceparent);
+  }
 
-    EREPORT_CURL_SLIST_APPEND(request_headers, "User-Agent: pg_net/" EXTVERSION);
+  handle->request_headers = request_headers;
 
-    handle->request_headers = request_headers;
+  // the request's own headers go first, reset_curl_handle unlinks the template's before freeing
+  struct curl_slist *http_headers = request_headers;
+  if (row.template && row.template->headers_slist) {
+    if (request_headers) {
+      struct curl_slist *last = request_headers;
+      while (last->next)
+        last = last->next;
+
+      last->next               = row.template->headers_slist;
+      handle->template_headers = last;
+    } else
+      http_headers = row.template->headers_slist;
   }
 
   handle->url = TextDatumGetCString(row.url);
@@ -68,6 +689,8 @@ void init_curl_handle(CurlHandle *handle, RequestQueueRow row) {
 
   handle->method = TextDatumGetCString(row.method);
 
+  handle->extract = !row.extractBin.isnull ? DatumGetJsonbPCopy(row.extractBin.value) : NULL;
+
   if (strcasecmp(handle->method, "GET") != 0 && strcasecmp(handle->method, "POST") != 0 &&
       strcasecmp(handle->method, "DELETE") != 0) {
     ereport(ERROR, errmsg("Unsupported request method %s", handle->method));
@@ -100,16 +723,61 @@ void init_curl_handle(CurlHandle *handle, RequestQueueRow row) {
   EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_WRITEDATA, handle);
   EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_HEADER, 0L);
   EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_URL, handle->url);
-  EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_HTTPHEADER, handle->request_headers);
+  EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_HTTPHEADER, http_headers);
+  // a User-Agent header of the request or its template replaces it
+  EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_USERAGENT, "pg_net/" EXTVERSION);
   EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_TIMEOUT_MS, (long)handle->timeout_milliseconds);
   EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_PRIVATE, handle);
   EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_FOLLOWLOCATION, (long)true);
+  EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_TCP_KEEPALIVE, 1L);
   if (LOG_MIN_MESSAGES <= DEBUG2) EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_VERBOSE, 1L);
-#if LIBCURL_VERSION_NUM >= 0x075500 /* libcurl 7.85.0 */
-  EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_PROTOCOLS_STR, "http,https");
-#else
-  EREPORT_CURL_SETOPT(handle->ez_handle, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
-#endif
+  set_curl_protocols(handle->ez_handle);
+  set_curl_transport(handle->ez_handle, handle->url);
+}
+
+// Adds a HEAD request to each of the comma separated origins, leaving an open connection to them on
+// the multi handle, or on the transfer thread that sends the requests to the origin when a pool is
+// given. These handles have no CURLOPT_PRIVATE, so no response is inserted for them.
+int add_warm_handles(CURLM *curl_mhandle, TransferPool *pool, const char *origins) {
+  static const long warm_timeout_ms = 5000;
+
+  char *raw_origins = pstrdup(origins);
+  List *origin_list = NIL;
+  int   added       = 0;
+
+  if (!SplitGUCList(raw_origins, ',', &origin_list)) {
+    ereport(WARNING, errmsg("invalid list syntax in pg_net.warm_origins"));
+    pfree(raw_origins);
+    return 0;
+  }
+
+  ListCell *lc;
+  foreach (lc, origin_list) {
+    char *origin    = (char *)lfirst(lc);
+    CURL *ez_handle = curl_easy_init();
+    if (!ez_handle) ereport(ERROR, errmsg("curl_easy_init()"));
+
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_URL, origin);
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_NOBODY, 1L);
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_TIMEOUT_MS, warm_timeout_ms);
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_USERAGENT, "pg_net/" EXTVERSION);
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    EREPORT_CURL_SETOPT(ez_handle, CURLOPT_PRIVATE, NULL);
+    if (LOG_MIN_MESSAGES <= DEBUG2) EREPORT_CURL_SETOPT(ez_handle, CURLOPT_VERBOSE, 1L);
+    set_curl_protocols(ez_handle);
+    set_curl_transport(ez_handle, origin);
+
+    if (pool == NULL)
+      EREPORT_MULTI(curl_multi_add_handle(curl_mhandle, ez_handle));
+    else if (transfer_pool_submit(pool, ez_handle, NULL, origin, 0) == NULL)
+      ereport(ERROR, errmsg("out of memory"));
+    added++;
+  }
+
+  list_free(origin_list);
+  pfree(raw_origins);
+
+  return added;
 }
 
 void set_curl_mhandle(WorkerState *wstate) {
@@ -130,8 +798,20 @@ uint64 delete_expired_responses(char *ttl, int batch_size) {
           ORDER BY created\
           LIMIT $2\
         )\
-        DELETE FROM net._http_response r\
-        USING rows WHERE r.ctid = rows.ctid",
+        deleted AS (\
+          DELETE FROM net._http_response r\
+          USING rows WHERE r.ctid = rows.ctid\
+          RETURNING r.id\
+        ),\
+        deleted_chunks AS (\
+          DELETE FROM net._http_response_chunk c\
+          USING deleted WHERE c.id = deleted.id\
+        ),\
+        deleted_spans AS (\
+          DELETE FROM net._http_request_span s\
+          USING deleted WHERE s.id = deleted.id\
+        )\
+        SELECT count(*) FROM deleted",
                                  2, (Oid[]){INTERVALOID, INT4OID});
     if (tmp == NULL)
       ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
@@ -147,48 +827,119 @@ uint64 delete_expired_responses(char *ttl, int batch_size) {
                 Int32GetDatum(batch_size)},
       NULL, false, 0);
 
-  uint64 affected_rows = SPI_processed;
-
-  if (ret_code != SPI_OK_DELETE) {
+  if (ret_code != SPI_OK_SELECT) {
     ereport(ERROR,
             errmsg("Error expiring response table rows: %s", SPI_result_code_string(ret_code)));
   }
 
+  bool   isnull;
+  uint64 affected_rows =
+      DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
   return affected_rows;
 }
 
-uint64 consume_request_queue(const int batch_size) {
-  if (del_return_queue_plan == NULL) {
+// Reads the batch of requests to send, taking them in turns from each tenant so one with a big
+// backlog can't delay the others until it's sent. Each tenant gets at most tenant_max_in_flight
+// requests in the batch, 0 means no limit. The tenants are found skipping through the
+// (tenant, id) index, one lookup each. The rows stay on the queue while their requests are in
+// flight, each one is deleted in the same transaction that inserts its response, see
+// insert_response_values.
+uint64 consume_request_queue(const int batch_size, const int tenant_max_in_flight, bool *drained) {
+  int per_tenant = tenant_max_in_flight > 0 ? Min(tenant_max_in_flight, batch_size) : batch_size;
+
+  if (sel_queue_plan == NULL) {
     SPIPlanPtr tmp = SPI_prepare("\
-        WITH\
-        rows AS (\
-          SELECT id\
-          FROM net.http_request_queue\
-          ORDER BY id\
-          LIMIT $1\
+        WITH RECURSIVE tenants AS (\
+          (SELECT tenant FROM net.http_request_queue ORDER BY tenant LIMIT 1)\
+          UNION ALL\
+          SELECT (\
+            SELECT q.tenant FROM net.http_request_queue q\
+            WHERE q.tenant > t.tenant\
+            ORDER BY q.tenant LIMIT 1\
+          )\
+          FROM tenants t\
+          WHERE t.tenant IS NOT NULL\
         )\
-        DELETE FROM net.http_request_queue q\
-        USING rows WHERE q.id = rows.id\
-        RETURNING q.id, q.method, q.url, timeout_milliseconds, array(select key || ': ' || value from jsonb_each_text(q.headers)), q.body",
-                                 1, (Oid[]){INT4OID});
+        SELECT r.id, r.method, r.url, r.timeout_milliseconds, r.headers, r.body, r.extract,\
+               r.traceparent, r.enqueued_at, r.aggregate_key, r.row_ctid, r.template, r.turn,\
+               r.params\
+        FROM tenants t\
+        CROSS JOIN LATERAL (\
+          SELECT q.*, q.ctid AS row_ctid, row_number() OVER (ORDER BY q.id) AS turn\
+          FROM net.http_request_queue q\
+          WHERE q.tenant = t.tenant\
+          ORDER BY q.id\
+          LIMIT $2\
+        ) r\
+        ORDER BY r.turn, r.id\
+        LIMIT $1",
+                                 2, (Oid[]){INT4OID, INT4OID});
 
     if (tmp == NULL)
       ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
 
-    del_return_queue_plan = SPI_saveplan(tmp);
-    if (del_return_queue_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+    sel_queue_plan = SPI_saveplan(tmp);
+    if (sel_queue_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
   }
 
-  int ret_code =
-      SPI_execute_plan(del_return_queue_plan, (Datum[]){Int32GetDatum(batch_size)}, NULL, false, 0);
+  int ret_code = SPI_execute_plan(
+      sel_queue_plan, (Datum[]){Int32GetDatum(batch_size), Int32GetDatum(per_tenant)}, NULL, true,
+      0);
 
-  if (ret_code != SPI_OK_DELETE_RETURNING)
+  if (ret_code != SPI_OK_SELECT)
     ereport(ERROR,
             errmsg("Error getting http request queue: %s", SPI_result_code_string(ret_code)));
 
+  // the rows are ordered by turn, when the last one is below the limit no tenant was left out
+  *drained = SPI_processed < (uint64)batch_size;
+  if (*drained && SPI_processed > 0) {
+    bool  isnull;
+    int64 last_turn = DatumGetInt64(
+        SPI_getbinval(SPI_tuptable->vals[SPI_processed - 1], SPI_tuptable->tupdesc, 13, &isnull));
+
+    *drained = last_turn < per_tenant;
+  }
+
   return SPI_processed;
 }
 
+// Dequeued rows stay on the queue heap as dead tuples until autovacuum gets to them, slowing down
+// every following dequeue. Once the queue is drained we truncate it instead, which gives it a fresh
+// empty heap. This is only done when nobody else is using the queue, so it never waits.
+bool truncate_request_queue(Oid queue_oid) {
+  static const BlockNumber min_blocks = 16;
+
+  // a truncate must see every committed row, which is not the case with a snapshot held for the
+  // whole transaction
+  if (IsolationUsesXactSnapshot()) return false;
+
+  Relation    queue_rel = relation_open(queue_oid, NoLock);
+  BlockNumber nblocks   = RelationGetNumberOfBlocks(queue_rel);
+  relation_close(queue_rel, NoLock);
+
+  if (nblocks < min_blocks) return false;
+
+  // the lock is kept until commit, when the truncate takes effect
+  if (!ConditionalLockRelationOid(queue_oid, AccessExclusiveLock)) return false;
+
+  // with the lock no requests can be enqueued, check with a new snapshot that none were committed
+  // since the transaction started
+  int ret_code = SPI_execute("select 1 from net.http_request_queue limit 1", false, 1);
+  if (ret_code != SPI_OK_SELECT)
+    ereport(ERROR, errmsg("Error checking the http request queue: %s",
+                          SPI_result_code_string(ret_code)));
+
+  if (SPI_processed > 0) return false;
+
+  ret_code = SPI_execute("truncate net.http_request_queue", false, 0);
+  if (ret_code != SPI_OK_UTILITY)
+    ereport(ERROR, errmsg("Error truncating the http request queue: %s",
+                          SPI_result_code_string(ret_code)));
+
+  return true;
+}
+
 // This has an implicit dependency on the execution of
 // delete_return_request_queue, unfortunately we're not able to make this
 // dependency explicit due to the design of SPI (which uses global variables)
@@ -201,8 +952,8 @@ RequestQueueRow get_request_queue_row(HeapTuple spi_tupval, TupleDesc spi_tupdes
   Datum method = SPI_getbinval(spi_tupval, spi_tupdesc, 2, &tupIsNull);
   EREPORT_NULL_ATTR(tupIsNull, method);
 
-  Datum url = SPI_getbinval(spi_tupval, spi_tupdesc, 3, &tupIsNull);
-  EREPORT_NULL_ATTR(tupIsNull, url);
+  bool  urlIsNull;
+  Datum url = SPI_getbinval(spi_tupval, spi_tupdesc, 3, &urlIsNull);
 
   int32 timeout_milliseconds = DatumGetInt32(SPI_getbinval(spi_tupval, spi_tupdesc, 4, &tupIsNull));
   EREPORT_NULL_ATTR(tupIsNull, timeout_milliseconds);
@@ -213,89 +964,606 @@ RequestQueueRow get_request_queue_row(HeapTuple spi_tupval, TupleDesc spi_tupdes
   NullableDatum bodyBin = {.value  = SPI_getbinval(spi_tupval, spi_tupdesc, 6, &tupIsNull),
                            .isnull = tupIsNull};
 
-  return (RequestQueueRow){id, method, url, timeout_milliseconds, headersBin, bodyBin};
+  NullableDatum extractBin = {.value  = SPI_getbinval(spi_tupval, spi_tupdesc, 7, &tupIsNull),
+                              .isnull = tupIsNull};
+
+  NullableDatum traceparentBin = {.value  = SPI_getbinval(spi_tupval, spi_tupdesc, 8, &tupIsNull),
+                                  .isnull = tupIsNull};
+
+  NullableDatum enqueuedAtBin = {.value  = SPI_getbinval(spi_tupval, spi_tupdesc, 9, &tupIsNull),
+                                 .isnull = tupIsNull};
+
+  NullableDatum aggregateKeyBin = {.value = SPI_getbinval(spi_tupval, spi_tupdesc, 10, &tupIsNull),
+                                   .isnull = tupIsNull};
+
+  Datum ctid = SPI_getbinval(spi_tupval, spi_tupdesc, 11, &tupIsNull);
+  EREPORT_NULL_ATTR(tupIsNull, ctid);
+
+  NullableDatum templateBin = {.value  = SPI_getbinval(spi_tupval, spi_tupdesc, 12, &tupIsNull),
+                               .isnull = tupIsNull};
+
+  // the url of a row with a template comes from it, see resolve_request_template
+  EREPORT_NULL_ATTR(urlIsNull && templateBin.isnull, url);
+
+  NullableDatum paramsBin = {.value  = SPI_getbinval(spi_tupval, spi_tupdesc, 14, &tupIsNull),
+                             .isnull = tupIsNull};
+
+  return (RequestQueueRow){id,
+                           method,
+                           url,
+                           timeout_milliseconds,
+                           headersBin,
+                           bodyBin,
+                           extractBin,
+                           traceparentBin,
+                           enqueuedAtBin,
+                           aggregateKeyBin,
+                           templateBin,
+                           paramsBin,
+                           *(ItemPointer)DatumGetPointer(ctid),
+                           NULL};
 }
 
-static Jsonb *jsonb_headers_from_curl_handle(CURL *ez_handle) {
-  struct curl_header *header, *prev = NULL;
-  PG_JSONB_INIT_STATE(headers);
-  (void)PG_JSONB_PUSH(headers, WJB_BEGIN_OBJECT, NULL);
+// A template prepared with net.prepare_request, kept by the worker with its headers already built
+struct RequestTemplate {
+  char               name[NAMEDATALEN]; // must be the first field
+  Datum              method;
+  char              *url;
+  int32              timeout_milliseconds;
+  Datum              headers; // text[] of `Name: value` lines, 0 when there are none
+  struct curl_slist *headers_slist;
+  Jsonb             *extract;
+};
 
-  while ((header = curl_easy_nextheader(ez_handle, CURLH_HEADER, 0, prev))) {
-    JsonbValue key   = {.type = jbvString,
-                        .val  = {.string = {.val = header->name, .len = strlen(header->name)}}};
-    JsonbValue value = {.type = jbvString,
-                        .val  = {.string = {.val = header->value, .len = strlen(header->value)}}};
-    (void)PG_JSONB_PUSH(headers, WJB_KEY, &key);
-    (void)PG_JSONB_PUSH(headers, WJB_VALUE, &value);
-    prev = header;
-  }
+static HTAB         *request_templates = NULL;
+static MemoryContext template_context  = NULL;
 
-  return PG_JSONB_OBJECT_FINISH(headers);
-}
+// Forgets the cached templates, the worker calls it when net.prepare_request changed them. No
+// transfer can be using their headers then.
+void reset_request_templates(void) {
+  if (request_templates == NULL) return;
 
-void insert_response(CurlHandle *handle, CURLcode curl_return_code) {
-  enum { nparams = 7 }; // using an enum because const size_t nparams doesn't compile
-  Datum vals[nparams];
-  char  nulls[nparams];
-  MemSet(nulls, 'n', nparams);
+  HASH_SEQ_STATUS  status;
+  RequestTemplate *template;
 
-  vals[0]  = Int64GetDatum(handle->id);
-  nulls[0] = ' ';
+  hash_seq_init(&status, request_templates);
+  while ((template = hash_seq_search(&status)) != NULL)
+    curl_slist_free_all(template->headers_slist);
 
-  if (curl_return_code == CURLE_OK) {
-    Jsonb *jsonb_headers        = jsonb_headers_from_curl_handle(handle->ez_handle);
-    long   res_http_status_code = 0;
+  hash_destroy(request_templates);
+  request_templates = NULL;
 
-    EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_RESPONSE_CODE, &res_http_status_code);
+  MemoryContextReset(template_context);
+}
 
-    vals[1]  = Int32GetDatum(res_http_status_code);
-    nulls[1] = ' ';
+static RequestTemplate *get_request_template(const char *name) {
+  if (request_templates == NULL) {
+    if (template_context == NULL)
+      template_context =
+          AllocSetContextCreate(TopMemoryContext, "pg_net request templates", ALLOCSET_SMALL_SIZES);
+
+    HASHCTL ctl = {
+      .keysize   = NAMEDATALEN,
+      .entrysize = sizeof(RequestTemplate),
+      .hcxt      = TopMemoryContext,
+    };
+    request_templates = hash_create("pg_net request templates", 16, &ctl,
+                                    HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+  }
 
-    if (handle->body && handle->body->data[0] != '\0') {
-      vals[2]  = CStringGetTextDatum(handle->body->data);
-      nulls[2] = ' ';
-    }
+  RequestTemplate *template = hash_search(request_templates, name, HASH_FIND, NULL);
+  if (template) return template;
 
-    vals[3]  = JsonbPGetDatum(jsonb_headers);
-    nulls[3] = ' ';
+  if (sel_template_plan == NULL) {
+    SPIPlanPtr tmp = SPI_prepare("\
+        SELECT method, url, headers, timeout_milliseconds, extract\
+        FROM net._http_request_template WHERE name = $1",
+                                 1, (Oid[]){TEXTOID});
 
-    struct curl_header *hdr;
-    if (curl_easy_header(handle->ez_handle, "content-type", 0, CURLH_HEADER, -1, &hdr) ==
-        CURLHE_OK) {
-      vals[4]  = CStringGetTextDatum(hdr->value);
-      nulls[4] = ' ';
-    }
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
 
-    vals[5]  = BoolGetDatum(false);
-    nulls[5] = ' ';
-  } else {
-    bool timed_out = curl_return_code == CURLE_OPERATION_TIMEDOUT;
+    sel_template_plan = SPI_saveplan(tmp);
+    if (sel_template_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
 
-    vals[5]  = BoolGetDatum(timed_out);
-    nulls[5] = ' ';
+    SPI_freeplan(tmp);
+  }
 
-    if (timed_out) {
-      curl_timeout_msg timeout_msg =
-          detailed_timeout_strerror(handle->ez_handle, handle->timeout_milliseconds);
+  int ret_code = SPI_execute_plan(sel_template_plan, (Datum[]){CStringGetTextDatum(name)}, NULL,
+                                  true, 1);
 
-      vals[6]  = CStringGetTextDatum(timeout_msg.msg);
-      nulls[6] = ' ';
-    } else {
-      const char *error_msg = curl_easy_strerror(curl_return_code);
+  if (ret_code != SPI_OK_SELECT)
+    ereport(ERROR,
+            errmsg("Error getting request template: %s", SPI_result_code_string(ret_code)));
 
-      if (error_msg) {
-        vals[6]  = CStringGetTextDatum(error_msg);
-        nulls[6] = ' ';
+  if (SPI_processed == 0) ereport(ERROR, errmsg("request template \"%s\" doesn't exist", name));
+
+  HeapTuple tuple = SPI_tuptable->vals[0];
+  TupleDesc desc  = SPI_tuptable->tupdesc;
+  bool      method_isnull, url_isnull, headers_isnull, timeout_isnull, extract_isnull;
+  Datum     method  = SPI_getbinval(tuple, desc, 1, &method_isnull);
+  Datum     url     = SPI_getbinval(tuple, desc, 2, &url_isnull);
+  Datum     headers = SPI_getbinval(tuple, desc, 3, &headers_isnull);
+  Datum     timeout = SPI_getbinval(tuple, desc, 4, &timeout_isnull);
+  Datum     extract = SPI_getbinval(tuple, desc, 5, &extract_isnull);
+
+  EREPORT_NULL_ATTR(method_isnull, method);
+  EREPORT_NULL_ATTR(url_isnull, url);
+  EREPORT_NULL_ATTR(timeout_isnull, timeout);
+
+  MemoryContext old_context = MemoryContextSwitchTo(template_context);
+
+  Datum  method_copy  = datumCopy(method, false, -1);
+  char  *url_copy     = TextDatumGetCString(url);
+  Datum  headers_copy = headers_isnull ? (Datum)0 : datumCopy(headers, false, -1);
+  Jsonb *extract_copy = extract_isnull ? NULL : DatumGetJsonbPCopy(extract);
+
+  MemoryContextSwitchTo(old_context);
+
+  struct curl_slist *headers_slist =
+      headers_isnull ? NULL : pg_text_array_to_slist(DatumGetArrayTypeP(headers), NULL);
+
+  template                       = hash_search(request_templates, name, HASH_ENTER, NULL);
+  template->method               = method_copy;
+  template->url                  = url_copy;
+  template->timeout_milliseconds = DatumGetInt32(timeout);
+  template->headers              = headers_copy;
+  template->headers_slist        = headers_slist;
+  template->extract              = extract_copy;
+
+  return template;
+}
+
+// Rows enqueued with net.http_prepared only carry their params and body, they have no url.
+// Everything else comes from their template as it is when the request is sent: the method, url,
+// headers, timeout and extract.
+void resolve_request_template(RequestQueueRow *row) {
+  row->template = NULL;
+
+  if (row->templateBin.isnull) return;
+
+  char            *name     = TextDatumGetCString(row->templateBin.value);
+  RequestTemplate *template = get_request_template(name);
+  pfree(name);
+
+  if (!row->paramsBin.isnull) {
+    char *query = TextDatumGetCString(row->paramsBin.value);
+    row->url    = CStringGetTextDatum(
+        psprintf("%s%c%s", template->url, strchr(template->url, '?') ? '&' : '?', query));
+    pfree(query);
+  } else
+    row->url = CStringGetTextDatum(template->url);
+
+  row->method               = template->method;
+  row->timeout_milliseconds = template->timeout_milliseconds;
+  row->headersBin = (NullableDatum){.value = template->headers, .isnull = template->headers == 0};
+  row->extractBin = (NullableDatum){.value  = PointerGetDatum(template->extract),
+                                    .isnull = template->extract == NULL};
+
+  row->template = template;
+}
+
+typedef struct {
+  char       *key; // must be the first field, see coalesce_key_hash
+  CurlHandle *leader;
+} CoalescedRequest;
+
+static uint32 coalesce_key_hash(const void *key, __attribute__((unused)) Size keysize) {
+  const char *str = *(const char *const *)key;
+  return DatumGetUInt32(hash_any((const unsigned char *)str, strlen(str)));
+}
+
+static int coalesce_key_match(const void *key1, const void *key2,
+                              __attribute__((unused)) Size keysize) {
+  return strcmp(*(const char *const *)key1, *(const char *const *)key2);
+}
+
+HTAB *create_coalesce_table(MemoryContext context, long nelem) {
+  HASHCTL ctl = {
+    .keysize   = sizeof(char *),
+    .entrysize = sizeof(CoalescedRequest),
+    .hash      = coalesce_key_hash,
+    .match     = coalesce_key_match,
+    .hcxt      = context,
+  };
+  return hash_create("pg_net coalesced requests", nelem, &ctl,
+                     HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+}
+
+static void append_text_datum(StringInfo str, Datum value) {
+  text *t = DatumGetTextPP(value);
+  appendBinaryStringInfo(str, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+}
+
+static void append_url_and_headers(StringInfo key, RequestQueueRow row) {
+  append_text_datum(key, row.url);
+
+  if (!row.headersBin.isnull) {
+    ArrayIterator iterator =
+        array_create_iterator(DatumGetArrayTypeP(row.headersBin.value), 0, NULL);
+    Datum value;
+    bool  isnull;
+
+    while (array_iterate(iterator, &value, &isnull)) {
+      if (isnull) continue;
+      appendStringInfoChar(key, '\n');
+      append_text_datum(key, value);
+    }
+    array_free_iterator(iterator);
+  }
+}
+
+// Only GET requests without a body can be coalesced or cached, they're identified by their url and
+// headers
+static char *request_key(RequestQueueRow row) {
+  char *method = TextDatumGetCString(row.method);
+  bool  is_get = pg_strcasecmp(method, "GET") == 0;
+  pfree(method);
+
+  if (!is_get || !row.bodyBin.isnull) return NULL;
+
+  StringInfoData key;
+  initStringInfo(&key);
+  append_url_and_headers(&key, row);
+
+  return key.data;
+}
+
+// Identical requests also have the same timeout and json paths to extract. Traced requests aren't
+// coalesced, each one has its own span.
+static char *coalesce_key(RequestQueueRow row) {
+  if (!row.traceparentBin.isnull) return NULL;
+
+  char *key = request_key(row);
+  if (key == NULL) return NULL;
+
+  char *extract = "";
+  if (!row.extractBin.isnull) {
+    Jsonb *spec = DatumGetJsonbP(row.extractBin.value);
+    extract     = JsonbToCString(NULL, &spec->root, VARSIZE(spec));
+  }
+
+  char *full_key = psprintf("%d\n%s\n%s", row.timeout_milliseconds, extract, key);
+  pfree(key);
+  return full_key;
+}
+
+// the row gets the response of the leader's transfer
+static void add_coalesced_row(CurlHandle *leader, RequestQueueRow row) {
+  if (leader->ncoalesced == leader->coalesced_capacity) {
+    leader->coalesced_capacity = Max(4, leader->coalesced_capacity * 2);
+    leader->coalesced_ids =
+        leader->coalesced_ids
+            ? repalloc(leader->coalesced_ids, sizeof(int64) * leader->coalesced_capacity)
+            : palloc(sizeof(int64) * leader->coalesced_capacity);
+    leader->coalesced_ctids =
+        leader->coalesced_ctids
+            ? repalloc(leader->coalesced_ctids,
+                       sizeof(ItemPointerData) * leader->coalesced_capacity)
+            : palloc(sizeof(ItemPointerData) * leader->coalesced_capacity);
+  }
+  leader->coalesced_ctids[leader->ncoalesced] = row.ctid;
+  leader->coalesced_ids[leader->ncoalesced++]  = row.id;
+}
+
+// Returns true when the row is identical to a request already in the batch, its id is then added to
+// that request so it gets the same response. Otherwise the row's handle becomes the one identical
+// rows will be coalesced into.
+bool coalesce_request(HTAB *coalesced, RequestQueueRow row, CurlHandle *handle) {
+  char *key = coalesce_key(row);
+  if (key == NULL) return false;
+
+  bool              found;
+  CoalescedRequest *entry = hash_search(coalesced, &key, HASH_ENTER, &found);
+
+  if (!found) {
+    entry->leader = handle;
+    return false;
+  }
+
+  add_coalesced_row(entry->leader, row);
+
+  pfree(key);
+  return true;
+}
+
+// Undoes coalesce_request for a handle that failed to initialize, so the identical rows that come
+// after it aren't coalesced into a handle slot that will be used by another request
+void forget_coalesce_leader(HTAB *coalesced, CurlHandle *handle) {
+  HASH_SEQ_STATUS   status;
+  CoalescedRequest *entry;
+
+  hash_seq_init(&status, coalesced);
+  while ((entry = hash_seq_search(&status)) != NULL) {
+    if (entry->leader == handle) {
+      hash_search(coalesced, &entry->key, HASH_REMOVE, NULL);
+      hash_seq_term(&status);
+      break;
+    }
+  }
+}
+
+void set_aggregate_limits(int max_requests, int max_size_kb) {
+  aggregate_max_requests = max_requests;
+  aggregate_max_size     = max_size_kb * 1024;
+}
+
+// The closing bracket of the leader's json array, which replaces the body set by init_curl_handle.
+// The transfer hasn't started yet, it's added to the multi handle but only runs in run_transfers.
+static void finish_aggregate(CurlHandle *leader) {
+  appendStringInfoChar(leader->aggregate_body, ']');
+
+  EREPORT_CURL_SETOPT(leader->ez_handle, CURLOPT_POSTFIELDSIZE, (long)leader->aggregate_body->len);
+  EREPORT_CURL_SETOPT(leader->ez_handle, CURLOPT_POSTFIELDS, leader->aggregate_body->data);
+}
+
+// Returns true when the row is a POST with an aggregate_key and the batch has a request with the
+// same key, url, headers, timeout and json paths to extract: its body is added to that request's
+// json array body and it gets the same response. Otherwise the row's handle starts a new array,
+// which is also the case once the current one has pg_net.aggregate_max_requests bodies or would
+// exceed pg_net.aggregate_max_size. A traced request always starts its own array, so its transfer
+// carries its span.
+bool aggregate_request(HTAB *aggregated, RequestQueueRow row, CurlHandle *handle) {
+  if (row.aggregateKeyBin.isnull || aggregate_max_requests < 2) return false;
+
+  char *method  = TextDatumGetCString(row.method);
+  bool  is_post = pg_strcasecmp(method, "POST") == 0;
+  pfree(method);
+
+  if (!is_post) return false;
+
+  StringInfoData key;
+  initStringInfo(&key);
+  appendStringInfo(&key, "%d\n", row.timeout_milliseconds);
+  append_text_datum(&key, row.aggregateKeyBin.value);
+  appendStringInfoChar(&key, '\n');
+
+  if (!row.extractBin.isnull) {
+    Jsonb *spec = DatumGetJsonbP(row.extractBin.value);
+    appendStringInfoString(&key, JsonbToCString(NULL, &spec->root, VARSIZE(spec)));
+  }
+  appendStringInfoChar(&key, '\n');
+  if (!row.traceparentBin.isnull) appendStringInfo(&key, INT64_FORMAT, row.id);
+  appendStringInfoChar(&key, '\n');
+  append_url_and_headers(&key, row);
+
+  bytea *body     = !row.bodyBin.isnull ? DatumGetByteaPP(row.bodyBin.value) : NULL;
+  int    body_len = body ? VARSIZE_ANY_EXHDR(body) : 4; // a missing body is a json null
+
+  bool              found;
+  CoalescedRequest *entry = hash_search(aggregated, &key.data, HASH_ENTER, &found);
+
+  if (found) {
+    CurlHandle *leader = entry->leader;
+    pfree(key.data);
+
+    if (leader->ncoalesced + 1 < aggregate_max_requests &&
+        leader->aggregate_body->len + 1 + body_len < aggregate_max_size) {
+      appendStringInfoChar(leader->aggregate_body, ',');
+      if (body)
+        appendBinaryStringInfo(leader->aggregate_body, VARDATA_ANY(body), body_len);
+      else
+        appendStringInfoString(leader->aggregate_body, "null");
+
+      add_coalesced_row(leader, row);
+      return true;
+    }
+
+    finish_aggregate(leader);
+  }
+
+  entry->leader          = handle;
+  handle->aggregate_body = makeStringInfo();
+  appendStringInfoChar(handle->aggregate_body, '[');
+  if (body)
+    appendBinaryStringInfo(handle->aggregate_body, VARDATA_ANY(body), body_len);
+  else
+    appendStringInfoString(handle->aggregate_body, "null");
+
+  return false;
+}
+
+// Closes the json arrays of the requests aggregated in the batch, once all its rows were added
+void finish_aggregates(HTAB *aggregated) {
+  HASH_SEQ_STATUS   status;
+  CoalescedRequest *entry;
+
+  hash_seq_init(&status, aggregated);
+  while ((entry = hash_seq_search(&status)) != NULL)
+    finish_aggregate(entry->leader);
+}
+
+static Jsonb *jsonb_headers_from_curl_handle(CURL *ez_handle) {
+  struct curl_header *header, *prev = NULL;
+  PG_JSONB_INIT_STATE(headers);
+  (void)PG_JSONB_PUSH(headers, WJB_BEGIN_OBJECT, NULL);
+
+  while ((header = curl_easy_nextheader(ez_handle, CURLH_HEADER, 0, prev))) {
+    JsonbValue key   = {.type = jbvString,
+                        .val  = {.string = {.val = header->name, .len = strlen(header->name)}}};
+    JsonbValue value = {.type = jbvString,
+                        .val  = {.string = {.val = header->value, .len = strlen(header->value)}}};
+    (void)PG_JSONB_PUSH(headers, WJB_KEY, &key);
+    (void)PG_JSONB_PUSH(headers, WJB_VALUE, &value);
+    prev = header;
+  }
+
+  return PG_JSONB_OBJECT_FINISH(headers);
+}
+
+static const char *response_header(CURL *ez_handle, const char *name) {
+  struct curl_header *hdr;
+  if (curl_easy_header(ez_handle, name, 0, CURLH_HEADER, -1, &hdr) != CURLHE_OK) return NULL;
+  return hdr->value;
+}
+
+// Returns false when the response must not be cached, otherwise sets when it stops being fresh. A
+// response without a max-age is still cached when it has a validator, it's then revalidated every
+// time it's used.
+static bool response_expiration(CURL *ez_handle, TimestampTz *expires_at) {
+  const char *cache_control = response_header(ez_handle, "cache-control");
+  long        max_age       = 0;
+  bool        s_maxage      = false;
+  bool        no_cache      = false;
+
+  if (cache_control) {
+    char *directives = pstrdup(cache_control);
+    char *saveptr;
+
+    for (char *tok = strtok_r(directives, ",", &saveptr); tok;
+         tok       = strtok_r(NULL, ",", &saveptr)) {
+      while (isspace((unsigned char)*tok))
+        tok++;
+
+      // the worker acts on behalf of every database user, so it's a shared cache
+      if (pg_strncasecmp(tok, "no-store", 8) == 0 || pg_strncasecmp(tok, "private", 7) == 0) {
+        pfree(directives);
+        return false;
+      } else if (pg_strncasecmp(tok, "no-cache", 8) == 0) {
+        no_cache = true;
+      } else if (pg_strncasecmp(tok, "s-maxage=", 9) == 0) {
+        max_age  = strtol(tok + 9, NULL, 10);
+        s_maxage = true;
+      } else if (pg_strncasecmp(tok, "max-age=", 8) == 0 && !s_maxage) {
+        max_age = strtol(tok + 8, NULL, 10);
       }
     }
+
+    pfree(directives);
+  }
+
+  if (no_cache) max_age = 0;
+
+  bool has_validator =
+      response_header(ez_handle, "etag") || response_header(ez_handle, "last-modified");
+
+  if (max_age <= 0 && !has_validator) return false;
+
+  *expires_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), Max(max_age, 0) * 1000);
+  return true;
+}
+
+static void insert_span_values(int64 id, const RequestTrace *trace, TimestampTz sent_at,
+                               TimestampTz first_byte_at, TimestampTz completed_at) {
+  if (ins_span_plan == NULL) {
+    SPIPlanPtr tmp = SPI_prepare(
+        "\
+        insert into net._http_request_span(id, trace_id, span_id, parent_span_id, enqueued_at, dequeued_at, sent_at, first_byte_at, completed_at)\
+        values ($1, $2, $3, $4, $5, $6, $7, $8, $9)",
+        9,
+        (Oid[]){INT8OID, TEXTOID, TEXTOID, TEXTOID, TIMESTAMPTZOID, TIMESTAMPTZOID,
+                TIMESTAMPTZOID, TIMESTAMPTZOID, TIMESTAMPTZOID});
+
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
+
+    ins_span_plan = SPI_saveplan(tmp);
+    if (ins_span_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+
+    SPI_freeplan(tmp);
+  }
+
+  Datum vals[9] = {
+    Int64GetDatum(id),
+    CStringGetTextDatum(trace->trace_id),
+    CStringGetTextDatum(trace->span_id),
+    CStringGetTextDatum(trace->parent_span_id),
+    TimestampTzGetDatum(trace->enqueued_at),
+    TimestampTzGetDatum(trace->dequeued_at),
+    TimestampTzGetDatum(sent_at),
+    TimestampTzGetDatum(first_byte_at),
+    TimestampTzGetDatum(completed_at),
+  };
+  char nulls[9] = {' ', ' ', ' ', trace->parent_span_id[0] ? ' ' : 'n', ' ', ' ',
+                   sent_at != 0 ? ' ' : 'n', first_byte_at != 0 ? ' ' : 'n', ' '};
+
+  int ret_code = SPI_execute_plan(ins_span_plan, vals, nulls, false, 0);
+
+  if (ret_code != SPI_OK_INSERT)
+    ereport(ERROR,
+            errmsg("Error when inserting request span: %s", SPI_result_code_string(ret_code)));
+}
+
+static void insert_span(CurlHandle *handle) {
+  RequestTrace *trace = handle->trace;
+  curl_off_t    pretransfer = 0, starttransfer = 0, total = 0;
+
+  // libcurl's times count from the start of the transfer, right after the dequeue
+  EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+  EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+  EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_TOTAL_TIME_T, &total);
+
+  // a zero time means the transfer didn't get to that phase
+  insert_span_values(handle->id, trace, pretransfer > 0 ? trace->dequeued_at + pretransfer : 0,
+                     starttransfer > 0 ? trace->dequeued_at + starttransfer : 0,
+                     trace->dequeued_at + total);
+}
+
+// The span of a traced request answered without a transfer, from the cache or the circuit breaker.
+// It has no sent and first byte times.
+static void insert_span_without_transfer(RequestQueueRow row) {
+  if (row.traceparentBin.isnull) return;
+
+  RequestTrace *trace = start_trace(row);
+  insert_span_values(row.id, trace, 0, 0, trace->dequeued_at);
+  pfree(trace);
+}
+
+static void set_cached_response_values(const CachedResponse *cached, Datum vals[], char nulls[]) {
+  vals[1]  = Int32GetDatum(cached->status_code);
+  nulls[1] = ' ';
+
+  if (cached->body) {
+    vals[2]  = CStringGetTextDatum(cached->body);
+    nulls[2] = ' ';
+  }
+
+  vals[3]  = JsonbPGetDatum(cached->headers);
+  nulls[3] = ' ';
+
+  if (cached->content_type) {
+    vals[4]  = CStringGetTextDatum(cached->content_type);
+    nulls[4] = ' ';
   }
 
+  vals[5]  = BoolGetDatum(false);
+  nulls[5] = ' ';
+}
+
+static void add_pending_extract(Datum id, Datum spec) {
+  if (nextract == extract_capacity) {
+    extract_capacity = Max(16, extract_capacity * 2);
+    extract_ids =
+        extract_ids ? repalloc(extract_ids, sizeof(Datum) * extract_capacity)
+                    : MemoryContextAlloc(TopTransactionContext, sizeof(Datum) * extract_capacity);
+    extract_specs =
+        extract_specs ? repalloc(extract_specs, sizeof(Datum) * extract_capacity)
+                      : MemoryContextAlloc(TopTransactionContext, sizeof(Datum) * extract_capacity);
+  }
+
+  extract_ids[nextract] = id;
+  extract_specs[nextract] =
+      PointerGetDatum(MemoryContextAllocZero(TopTransactionContext, VARSIZE_ANY(spec)));
+  memcpy(DatumGetPointer(extract_specs[nextract]), DatumGetPointer(spec), VARSIZE_ANY(spec));
+  nextract++;
+}
+
+// Inserts the response for vals[0] and for the requests coalesced into it. When vals[7] has json
+// paths, the values they extract from a json body replace it before the transaction commits, see
+// extract_json_responses. The queue row at vals[8] is deleted by the same statement, so once the
+// transaction commits the request is done for good and isn't sent again if the worker fails later.
+static void insert_response_values(Datum vals[], char nulls[], const int64 *coalesced_ids,
+                                   const ItemPointerData *coalesced_ctids, int ncoalesced) {
   if (ins_response_plan == NULL) {
     SPIPlanPtr tmp = SPI_prepare(
         "\
-        insert into net._http_response(id, status_code, content, headers, content_type, timed_out, error_msg) values ($1, $2, $3, $4, $5, $6, $7)",
-        nparams, (Oid[nparams]){INT8OID, INT4OID, TEXTOID, JSONBOID, TEXTOID, BOOLOID, TEXTOID});
+        with done as (delete from net.http_request_queue where ctid = $9 and id = $1 returning 1)\
+        insert into net._http_response(id, status_code, content, headers, content_type, timed_out, error_msg)\
+        select $1, $2, $3, $4, $5, $6, $7\
+        where exists (select 1 from done)",
+        response_nparams,
+        (Oid[response_nparams]){INT8OID, INT4OID, TEXTOID, JSONBOID, TEXTOID, BOOLOID, TEXTOID,
+                                JSONBOID, TIDOID});
 
     if (tmp == NULL)
       ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
@@ -306,21 +1574,549 @@ void insert_response(CurlHandle *handle, CURLcode curl_return_code) {
     SPI_freeplan(tmp);
   }
 
-  int ret_code = SPI_execute_plan(ins_response_plan, vals, nulls, false, 0);
+  // the requests coalesced into this one get the same response
+  for (int i = -1; i < ncoalesced; i++) {
+    if (i >= 0) {
+      vals[0] = Int64GetDatum(coalesced_ids[i]);
+      vals[8] = PointerGetDatum(&coalesced_ctids[i]);
+    }
+
+    int ret_code = SPI_execute_plan(ins_response_plan, vals, nulls, false, 0);
+
+    if (ret_code != SPI_OK_INSERT) {
+      ereport(ERROR,
+              errmsg("Error when inserting response: %s", SPI_result_code_string(ret_code)));
+    }
+
+    if (SPI_processed > 0 && nulls[7] == ' ' && nulls[2] == ' ')
+      add_pending_extract(vals[0], vals[7]);
+
+    // the requests cancelled or dropped meanwhile left the queue already
+    completed_requests += SPI_processed;
+  }
+}
+
+static void execute_extract_plan(SPIPlanPtr *plan, const char *query, Datum ids, Datum specs) {
+  if (*plan == NULL) {
+    SPIPlanPtr tmp = SPI_prepare(query, 2, (Oid[]){INT8ARRAYOID, JSONBARRAYOID});
+
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
+
+    *plan = SPI_saveplan(tmp);
+    if (*plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+
+    SPI_freeplan(tmp);
+  }
+
+  int ret_code = SPI_execute_plan(*plan, (Datum[]){ids, specs}, NULL, false, 0);
+
+  if (ret_code != SPI_OK_UPDATE)
+    ereport(ERROR, errmsg("Error extracting json: %s", SPI_result_code_string(ret_code)));
+}
 
-  if (ret_code != SPI_OK_INSERT) {
-    ereport(ERROR, errmsg("Error when inserting response: %s", SPI_result_code_string(ret_code)));
+// Replaces the bodies of the responses inserted with json paths by the values the paths extract,
+// must be called before the transaction commits. All the bodies are cast to jsonb by one statement
+// in a single subtransaction. Only when one of them isn't json they're cast one by one, and the
+// bodies that aren't json are kept as they are.
+void extract_json_responses(void) {
+  if (nextract == 0) return;
+
+  Datum ids = PointerGetDatum(
+      construct_array(extract_ids, nextract, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+  Datum specs = PointerGetDatum(construct_array(extract_specs, nextract, JSONBOID, -1, false, 'i'));
+
+  extract_ids      = NULL;
+  extract_specs    = NULL;
+  nextract         = 0;
+  extract_capacity = 0;
+
+  MemoryContext context   = CurrentMemoryContext;
+  ResourceOwner owner     = CurrentResourceOwner;
+  volatile bool extracted = false;
+
+  BeginInternalSubTransaction(NULL);
+  MemoryContextSwitchTo(context);
+
+  PG_TRY();
+  {
+    execute_extract_plan(&extract_plan, "\
+        update net._http_response r\
+        set content = null, extracted = net._extract_json(r.content::jsonb, p.extract)\
+        from unnest($1, $2) p(id, extract)\
+        where r.id = p.id and r.content is not null",
+                         ids, specs);
+
+    ReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(context);
+    CurrentResourceOwner = owner;
+    extracted = true;
   }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(context);
+    FlushErrorState();
+
+    RollbackAndReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(context);
+    CurrentResourceOwner = owner;
+  }
+  PG_END_TRY();
+
+  if (!extracted)
+    execute_extract_plan(&extract_each_plan, "\
+        with docs as (\
+          select r.ctid, net._extract_json(net._to_jsonb(r.content), p.extract) as extracted\
+          from net._http_response r join unnest($1, $2) p(id, extract) on r.id = p.id\
+          where r.content is not null\
+        )\
+        update net._http_response r\
+        set content = case when d.extracted is null then r.content end, extracted = d.extracted\
+        from docs d where r.ctid = d.ctid",
+                         ids, specs);
 }
 
-void pfree_handle(CurlHandle *handle) {
-  pfree(handle->url);
-  pfree(handle->method);
-  if (handle->req_body) pfree(handle->req_body);
+// Returns the number of requests that got their response since the last call, these left the queue
+// once the transaction commits
+uint64 pop_completed_requests(void) {
+  uint64 completed   = completed_requests;
+  completed_requests = 0;
+  return completed;
+}
+
+// Deletes up to count of the newest queued requests with a priority lower than the given one, they
+// get an error response instead. Called by the backends enqueueing requests when the queue is full.
+// The rows being deleted by the worker are skipped. The ones whose requests are in flight are
+// dropped like net.cancel does, their transfers are stopped once the transaction commits and the
+// worker finds no queue row to insert their response for.
+uint64 drop_queued_requests(int32 priority, int32 count) {
+  SPI_connect();
+
+  if (drop_queue_plan == NULL) {
+    SPIPlanPtr tmp = SPI_prepare("\
+        WITH\
+        dropped AS (\
+          DELETE FROM net.http_request_queue q\
+          USING (\
+            SELECT id FROM net.http_request_queue\
+            WHERE priority < $1\
+            ORDER BY priority, id DESC\
+            LIMIT $2\
+            FOR UPDATE SKIP LOCKED\
+          ) d\
+          WHERE q.id = d.id\
+          RETURNING q.id\
+        )\
+        INSERT INTO net._http_response(id, timed_out, error_msg)\
+        SELECT id, false, 'Dropped to make room for a higher priority request, the queue was full'\
+        FROM dropped",
+                                 2, (Oid[]){INT4OID, INT4OID});
 
-  if (handle->body) destroyStringInfo(handle->body);
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
+
+    drop_queue_plan = SPI_saveplan(tmp);
+    if (drop_queue_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+
+    SPI_freeplan(tmp);
+  }
+
+  int ret_code = SPI_execute_plan(
+      drop_queue_plan, (Datum[]){Int32GetDatum(priority), Int32GetDatum(count)}, NULL, false, 0);
+
+  if (ret_code != SPI_OK_INSERT)
+    ereport(ERROR,
+            errmsg("Error dropping queued requests: %s", SPI_result_code_string(ret_code)));
+
+  uint64 dropped = SPI_processed;
+
+  SPI_finish();
+
+  return dropped;
+}
+
+static int compare_ctids(const void *a, const void *b) {
+  return ItemPointerCompare((ItemPointer)a, (ItemPointer)b);
+}
+
+// The queue rows of the handles' requests that are still there, sorted. A single query checks the
+// whole batch.
+static ItemPointerData *get_queued_ctids(CurlHandle *handles, size_t nhandles, int *nqueued) {
+  int    nctids = 0;
+  Datum *ctids  = NULL;
+
+  for (size_t i = 0; i < nhandles; i++) {
+    if (!ItemPointerIsValid(&handles[i].ctid)) continue;
+
+    ctids = ctids ? repalloc(ctids, sizeof(Datum) * (nctids + 1 + handles[i].ncoalesced))
+                  : palloc(sizeof(Datum) * (1 + handles[i].ncoalesced));
+
+    ctids[nctids++] = PointerGetDatum(&handles[i].ctid);
+    for (int j = 0; j < handles[i].ncoalesced; j++)
+      ctids[nctids++] = PointerGetDatum(&handles[i].coalesced_ctids[j]);
+  }
+
+  *nqueued = 0;
+  if (nctids == 0) return NULL;
+
+  if (sel_queued_plan == NULL) {
+    SPIPlanPtr tmp = SPI_prepare("SELECT ctid FROM net.http_request_queue WHERE ctid = ANY($1)", 1,
+                                 (Oid[]){get_array_type(TIDOID)});
+
+    if (tmp == NULL)
+      ereport(ERROR, errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result)));
+
+    sel_queued_plan = SPI_saveplan(tmp);
+    if (sel_queued_plan == NULL) ereport(ERROR, errmsg("SPI_saveplan failed"));
+
+    SPI_freeplan(tmp);
+  }
+
+  Datum ctid_array = PointerGetDatum(
+      construct_array(ctids, nctids, TIDOID, sizeof(ItemPointerData), false, 's'));
+
+  // not read only, so the rows deleted by the cancels committed meanwhile aren't seen
+  int ret_code = SPI_execute_plan(sel_queued_plan, (Datum[]){ctid_array}, NULL, false, 0);
+
+  if (ret_code != SPI_OK_SELECT)
+    ereport(ERROR,
+            errmsg("Error checking the request queue: %s", SPI_result_code_string(ret_code)));
+
+  ItemPointerData *queued = palloc(sizeof(ItemPointerData) * Max(1, SPI_processed));
+
+  for (uint64 i = 0; i < SPI_processed; i++) {
+    bool isnull;
+    queued[i] = *DatumGetItemPointer(
+        SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull));
+  }
+
+  *nqueued = (int)SPI_processed;
+  qsort(queued, *nqueued, sizeof(ItemPointerData), compare_ctids);
+
+  pfree(ctids);
+
+  return queued;
+}
+
+static bool is_queued(ItemPointer ctid, ItemPointerData *queued, int nqueued) {
+  return nqueued > 0 &&
+         bsearch(ctid, queued, nqueued, sizeof(ItemPointerData), compare_ctids) != NULL;
+}
+
+// A transfer is cancelled when net.cancel deleted the queue rows of all the requests waiting for
+// it. Sets cancelled for the handles of the batch whose transfer is cancelled and returns how many
+// they are. Their ctid is cleared, so they're only found once, like the handles whose response was
+// stored, see insert_response.
+int find_cancelled_transfers(CurlHandle *handles, size_t nhandles, bool *cancelled) {
+  int              nqueued;
+  ItemPointerData *queued     = get_queued_ctids(handles, nhandles, &nqueued);
+  int              ncancelled = 0;
+
+  for (size_t i = 0; i < nhandles; i++) {
+    CurlHandle *handle = &handles[i];
+    cancelled[i]       = false;
+
+    if (!ItemPointerIsValid(&handle->ctid) || is_queued(&handle->ctid, queued, nqueued)) continue;
+
+    bool coalesced_queued = false;
+    for (int j = 0; j < handle->ncoalesced && !coalesced_queued; j++)
+      coalesced_queued = is_queued(&handle->coalesced_ctids[j], queued, nqueued);
+
+    if (coalesced_queued) continue;
+
+    ItemPointerSetInvalid(&handle->ctid);
+    cancelled[i] = true;
+    ncancelled++;
+  }
+
+  if (queued) pfree(queued);
+
+  return ncancelled;
+}
+
+// Inserts an error response for a row that got no transfer
+void insert_error_response(RequestQueueRow row, const char *error_msg) {
+  Datum vals[response_nparams];
+  char  nulls[response_nparams];
+  MemSet(nulls, 'n', response_nparams);
+
+  vals[0]  = Int64GetDatum(row.id);
+  nulls[0] = ' ';
+  vals[5]  = BoolGetDatum(false);
+  nulls[5] = ' ';
+  vals[6]  = CStringGetTextDatum(error_msg);
+  nulls[6] = ' ';
+  vals[8]  = PointerGetDatum(&row.ctid);
+  nulls[8] = ' ';
+
+  insert_response_values(vals, nulls, NULL, NULL, 0);
+}
+
+// Returns true when the row's host failed pg_net.circuit_breaker_failures consecutive times, an
+// error response is then inserted for the row without a transfer. Once the cool-down is over, the
+// circuit is half open: one request goes through as a probe while the others keep failing fast,
+// its success closes the circuit and its failure opens it for another cool-down.
+bool reject_by_circuit_breaker(RequestQueueRow row, CurlHandle *handle) {
+  handle->circuit_host = NULL;
+
+  if (host_circuits == NULL) return false;
+
+  char *url  = TextDatumGetCString(row.url);
+  char *host = url_host(url, true);
+  pfree(url);
+
+  if (host == NULL) return false;
+
+  HostCircuit *circuit = hash_search(host_circuits, host, HASH_FIND, NULL);
+
+  if (circuit && circuit->failures >= circuit_breaker_failures) {
+    TimestampTz now = GetCurrentTimestamp();
+
+    if (now < circuit->open_until) {
+      insert_span_without_transfer(row);
+      insert_error_response(
+          row, psprintf("Circuit breaker open for host %s after %d consecutive connection failures",
+                        host, circuit->failures));
+
+      pfree(host);
+      return true;
+    }
+
+    // this request is the probe, if its outcome is lost the next one comes after another cool-down
+    circuit->open_until = TimestampTzPlusMilliseconds(now, circuit_breaker_cooldown);
+  }
+
+  handle->circuit_host = host;
+  return false;
+}
+
+// Looks the row up in the response cache and returns true when a fresh response was found, it's
+// then inserted for the row right away. Otherwise the handle keeps the key to cache the response it
+// gets, plus the stale cached response so init_curl_handle makes a conditional request.
+bool serve_cached_response(RequestQueueRow row, CurlHandle *handle) {
+  handle->cache_key = NULL;
+  handle->cached    = NULL;
+
+  char *key = request_key(row);
+  if (key == NULL) return false;
+
+  CachedResponse cached;
+
+  if (cache_lookup(key, &cached)) {
+    if (cached.fresh) {
+      Datum vals[response_nparams];
+      char  nulls[response_nparams];
+      MemSet(nulls, 'n', response_nparams);
+
+      vals[0]  = Int64GetDatum(row.id);
+      nulls[0] = ' ';
+      vals[8]  = PointerGetDatum(&row.ctid);
+      nulls[8] = ' ';
+
+      set_cached_response_values(&cached, vals, nulls);
+
+      if (!row.extractBin.isnull) {
+        vals[7]  = row.extractBin.value;
+        nulls[7] = ' ';
+      }
+
+      insert_span_without_transfer(row);
+      insert_response_values(vals, nulls, NULL, NULL, 0);
+
+      pfree(key);
+      return true;
+    }
+
+    if (cached.etag || cached.last_modified) {
+      handle->cached  = palloc(sizeof(CachedResponse));
+      *handle->cached = cached;
+    }
+  }
+
+  handle->cache_key = key;
+  return false;
+}
+
+void insert_response(CurlHandle *handle, CURLcode curl_return_code) {
+  Datum vals[response_nparams];
+  char  nulls[response_nparams];
+  MemSet(nulls, 'n', response_nparams);
+
+  vals[0]  = Int64GetDatum(handle->id);
+  nulls[0] = ' ';
+  vals[8]  = PointerGetDatum(&handle->ctid);
+  nulls[8] = ' ';
+
+  if (handle->circuit_host && host_circuits)
+    record_circuit_outcome(handle->circuit_host, curl_return_code);
+
+  if (handle->limit_host && host_limits) record_concurrency_outcome(handle, curl_return_code);
+
+  if (handle->trace) insert_span(handle);
+
+  // the rest of a chunked body goes with its other chunks, leaving the content null
+  if (handle->nchunks > 0 && handle->body->len > 0) write_body_chunk(handle);
+
+  if (curl_return_code == CURLE_OK) {
+    long        res_http_status_code = 0;
+    TimestampTz expires_at;
+
+    EREPORT_CURL_GETINFO(handle->ez_handle, CURLINFO_RESPONSE_CODE, &res_http_status_code);
+
+    if (res_http_status_code == 304 && handle->cached) {
+      // the stale cached response is still valid
+      if (response_expiration(handle->ez_handle, &expires_at))
+        cache_store(handle->cache_key, handle->cached, expires_at);
+
+      set_cached_response_values(handle->cached, vals, nulls);
+    } else {
+      Jsonb *jsonb_headers = jsonb_headers_from_curl_handle(handle->ez_handle);
+      char  *body = handle->body && handle->body->data[0] != '\0' ? handle->body->data : NULL;
+
+      vals[1]  = Int32GetDatum(res_http_status_code);
+      nulls[1] = ' ';
+
+      if (body) {
+        vals[2]  = CStringGetTextDatum(body);
+        nulls[2] = ' ';
+      }
+
+      vals[3]  = JsonbPGetDatum(jsonb_headers);
+      nulls[3] = ' ';
+
+      const char *content_type = response_header(handle->ez_handle, "content-type");
+      if (content_type) {
+        vals[4]  = CStringGetTextDatum(content_type);
+        nulls[4] = ' ';
+      }
+
+      vals[5]  = BoolGetDatum(false);
+      nulls[5] = ' ';
+
+      if (handle->cache_key && handle->nchunks == 0 && res_http_status_code == 200 &&
+          response_expiration(handle->ez_handle, &expires_at)) {
+        CachedResponse response = {
+          .status_code   = res_http_status_code,
+          .content_type  = (char *)content_type,
+          .etag          = (char *)response_header(handle->ez_handle, "etag"),
+          .last_modified = (char *)response_header(handle->ez_handle, "last-modified"),
+          .headers       = jsonb_headers,
+          .body          = body,
+        };
+        cache_store(handle->cache_key, &response, expires_at);
+      }
+    }
+  } else {
+    bool timed_out = curl_return_code == CURLE_OPERATION_TIMEDOUT;
+
+    vals[5]  = BoolGetDatum(timed_out);
+    nulls[5] = ' ';
+
+    if (timed_out) {
+      curl_timeout_msg timeout_msg =
+          detailed_timeout_strerror(handle->ez_handle, handle->timeout_milliseconds);
+
+      vals[6]  = CStringGetTextDatum(timeout_msg.msg);
+      nulls[6] = ' ';
+    } else {
+      const char *error_msg = curl_easy_strerror(curl_return_code);
+
+      if (error_msg) {
+        vals[6]  = CStringGetTextDatum(error_msg);
+        nulls[6] = ' ';
+      }
+    }
+  }
+
+  if (handle->extract) {
+    vals[7]  = JsonbPGetDatum(handle->extract);
+    nulls[7] = ' ';
+  }
+
+  insert_response_values(vals, nulls, handle->coalesced_ids, handle->coalesced_ctids,
+                         handle->ncoalesced);
+
+  // its queue rows are gone now, this tells find_cancelled_transfers the transfer completed
+  ItemPointerSetInvalid(&handle->ctid);
+}
+
+// Runs the request inside the calling backend and returns it as a net.http_response tuple. The wait
+// for the transfer is interrupted every sync_poll_ms, so the query can be cancelled or hit
+// statement_timeout. Failed transfers are reported as errors.
+HeapTuple perform_sync_request(RequestQueueRow row, TupleDesc tupdesc) {
+  if (sync_mhandle == NULL) {
+    sync_mhandle = curl_multi_init();
+    if (!sync_mhandle) ereport(ERROR, errmsg("curl_multi_init()"));
+  }
+
+  // the previous call was interrupted
+  if (sync_handle_added) {
+    EREPORT_MULTI(curl_multi_remove_handle(sync_mhandle, sync_handle.ez_handle));
+    sync_handle_added = false;
+  }
+  reset_curl_handle(&sync_handle);
+
+  init_curl_handle(&sync_handle, row);
+
+  EREPORT_MULTI(curl_multi_add_handle(sync_mhandle, sync_handle.ez_handle));
+  sync_handle_added = true;
+
+  int running_handles = 0;
+  do {
+    CHECK_FOR_INTERRUPTS();
+
+    EREPORT_MULTI(curl_multi_perform(sync_mhandle, &running_handles));
+
+    if (running_handles > 0)
+      EREPORT_MULTI(curl_multi_poll(sync_mhandle, NULL, 0, sync_poll_ms, NULL));
+  } while (running_handles > 0);
+
+  CURLcode curl_return_code = CURLE_OK;
+  CURLMsg *msg              = NULL;
+  int      msgs_left        = 0;
+  while ((msg = curl_multi_info_read(sync_mhandle, &msgs_left))) {
+    if (msg->msg == CURLMSG_DONE) curl_return_code = msg->data.result;
+  }
+
+  EREPORT_MULTI(curl_multi_remove_handle(sync_mhandle, sync_handle.ez_handle));
+  sync_handle_added = false;
+
+  if (curl_return_code == CURLE_OPERATION_TIMEDOUT) {
+    curl_timeout_msg timeout_msg =
+        detailed_timeout_strerror(sync_handle.ez_handle, sync_handle.timeout_milliseconds);
+    ereport(ERROR, errmsg("%s", timeout_msg.msg));
+  } else if (curl_return_code != CURLE_OK) {
+    ereport(ERROR, errmsg("%s", curl_easy_strerror(curl_return_code)));
+  }
+
+  long res_http_status_code = 0;
+  EREPORT_CURL_GETINFO(sync_handle.ez_handle, CURLINFO_RESPONSE_CODE, &res_http_status_code);
+
+  Datum values[3];
+  bool  nulls[3] = {false, false, true};
+
+  values[0] = Int32GetDatum(res_http_status_code);
+  values[1] = JsonbPGetDatum(jsonb_headers_from_curl_handle(sync_handle.ez_handle));
+
+  if (sync_handle.body->data[0] != '\0') {
+    values[2] = CStringGetTextDatum(sync_handle.body->data);
+    nulls[2]  = false;
+  }
+
+  HeapTuple tuple = heap_form_tuple(tupdesc, values, nulls);
+
+  reset_curl_handle(&sync_handle);
+
+  return tuple;
+}
+
+void reset_curl_handle(CurlHandle *handle) {
+  if (handle->template_headers) handle->template_headers->next = NULL;
 
   if (handle->request_headers) // curl_slist_free_all already handles the NULL
                                // case, but be explicit about it
     curl_slist_free_all(handle->request_headers);
+
+  CURL *ez_handle = handle->ez_handle;
+  *handle         = (CurlHandle){.ez_handle = ez_handle};
 }
@@ -1,58 +1,180 @@
 #ifndef CORE_H
 #define CORE_H
 
+#include "cache.h"
+#include "transfers.h"
+
 typedef enum {
   WS_NOT_YET = 1,
   WS_RUNNING,
   WS_EXITED,
 } WorkerStatus;
 
+// the phases of a worker iteration, see net.worker_profile
+typedef enum {
+  PHASE_EXPIRE,   // delete_expired_responses
+  PHASE_DEQUEUE,  // consume_request_queue
+  PHASE_INIT,     // init_curl_handle for the whole batch
+  PHASE_TRANSFER, // the event loop, without the inserts of responses
+  PHASE_INSERT,   // insert_response
+  PHASE_COMMIT,   // CommitTransactionCommand
+  WORKER_PHASE_COUNT,
+} WorkerPhase;
+
+// Time spent by the worker in a phase. Only the worker adds to it, backends read and reset it
+typedef struct {
+  pg_atomic_uint64 calls;
+  pg_atomic_uint64 total_us;
+  pg_atomic_uint64 max_us;
+} PhaseProfile;
+
 // the state of the background worker
 typedef struct {
+  Oid               database_oid; // the database served, InvalidOid when the slot is free
   pg_atomic_uint32  got_restart;
   pg_atomic_uint32  should_wake;
+  pg_atomic_uint32  got_cancel; // set when net.cancel commits, see find_cancelled_transfers
+  pg_atomic_uint32  templates_generation; // see reset_request_templates
   pg_atomic_uint32  status;
+  int               pid;        // of the worker once it started, see is_worker_gone
+  TimestampTz       claimed_at; // when the slot was last claimed for a worker to launch
   Latch            *shared_latch;
   ConditionVariable cv; // required to publish the state of the worker to other backends
   int               epfd;
   CURLM            *curl_mhandle;
+  PhaseProfile      profile[WORKER_PHASE_COUNT];
+  pg_atomic_uint64  queue_depth; // approximate, see net._admit_request
 } WorkerState;
 
+// see resolve_request_template
+typedef struct RequestTemplate RequestTemplate;
+
 // A row coming from the http_request_queue
 typedef struct {
-  int64         id;
-  Datum         method;
-  Datum         url;
-  int32         timeout_milliseconds;
-  NullableDatum headersBin;
-  NullableDatum bodyBin;
+  int64            id;
+  Datum            method;
+  Datum            url;
+  int32            timeout_milliseconds;
+  NullableDatum    headersBin;
+  NullableDatum    bodyBin;
+  NullableDatum    extractBin;
+  NullableDatum    traceparentBin;
+  NullableDatum    enqueuedAtBin;
+  NullableDatum    aggregateKeyBin;
+  NullableDatum    templateBin;
+  NullableDatum    paramsBin; // the query string of a row with a template, see net.http_prepared
+  ItemPointerData  ctid;     // the row is deleted along with the insert of its response
+  RequestTemplate *template; // set by resolve_request_template
 } RequestQueueRow;
 
+// The W3C trace context of a request enqueued while pg_net.tracing was on, its span is recorded in
+// net._http_request_span
+typedef struct {
+  char        trace_id[33];
+  char        span_id[17];
+  char        parent_span_id[17]; // empty when the caller gave no traceparent
+  char        flags[3];
+  bool        user_header; // the request has its own traceparent header, it's sent as it is
+  TimestampTz enqueued_at;
+  TimestampTz dequeued_at;
+} RequestTrace;
+
 // The curl easy handle plus additional data, this acts for both the request and
 // response cycle
 typedef struct {
   int64              id;
   StringInfo         body;
   struct curl_slist *request_headers;
+  struct curl_slist *template_headers; // the last of request_headers, linked to its template's
   int32              timeout_milliseconds;
   char              *url;
   char              *req_body;
   char              *method;
   CURL              *ez_handle;
+  ItemPointerData    ctid;          // of the queue row, see RequestQueueRow
+  int64             *coalesced_ids; // requests sharing this one's transfer, see coalesce_request
+  ItemPointerData   *coalesced_ctids;
+  int                ncoalesced;
+  int                coalesced_capacity;
+  StringInfo         aggregate_body; // json array of the aggregated bodies, see aggregate_request
+  char              *cache_key; // set when the response can be cached, see serve_cached_response
+  CachedResponse    *cached;    // the stale cached response being revalidated
+  char              *circuit_host; // set when the circuit breaker tracks the request's host
+  char              *limit_host;   // set when its host's concurrency adapts, see
+                                   // defer_by_concurrency_limit
+  Jsonb             *extract;      // json paths evaluated on the body, see net._extract_json
+  int                nchunks;      // body chunks written so far, see set_body_chunk_size
+  bool               paused;       // waiting for its body chunk to be written
+  Transfer          *transfer;     // while a transfer thread sends it, see pg_net.transfer_threads
+  RequestTrace      *trace;
 } CurlHandle;
 
 uint64 delete_expired_responses(char *ttl, int batch_size);
 
-uint64 consume_request_queue(const int batch_size);
+uint64 consume_request_queue(const int batch_size, const int tenant_max_in_flight, bool *drained);
+
+bool truncate_request_queue(Oid queue_oid);
 
 RequestQueueRow get_request_queue_row(HeapTuple spi_tupval, TupleDesc spi_tupdesc);
 
+void resolve_request_template(RequestQueueRow *row);
+
+void reset_request_templates(void);
+
 void set_curl_mhandle(WorkerState *wstate);
 
+void set_transport_config(const char *proxy_url, const char *unix_socket_routes);
+
+void set_body_chunk_size(int chunk_size_kb);
+
+void resume_paused_transfers(void);
+
+void write_body_chunk(CurlHandle *handle);
+
 void insert_response(CurlHandle *handle, CURLcode curl_return_code);
 
 void init_curl_handle(CurlHandle *handle, RequestQueueRow row);
 
-void pfree_handle(CurlHandle *handle);
+HTAB *create_coalesce_table(MemoryContext context, long nelem);
+
+bool coalesce_request(HTAB *coalesced, RequestQueueRow row, CurlHandle *handle);
+
+void forget_coalesce_leader(HTAB *coalesced, CurlHandle *handle);
+
+void set_aggregate_limits(int max_requests, int max_size_kb);
+
+bool aggregate_request(HTAB *aggregated, RequestQueueRow row, CurlHandle *handle);
+
+void finish_aggregates(HTAB *aggregated);
+
+void insert_error_response(RequestQueueRow row, const char *error_msg);
+
+uint64 pop_completed_requests(void);
+
+void extract_json_responses(void);
+
+uint64 drop_queued_requests(int32 priority, int32 count);
+
+int find_cancelled_transfers(CurlHandle *handles, size_t nhandles, bool *cancelled);
+
+void set_circuit_breaker_config(int failures, int cooldown_ms);
+
+bool reject_by_circuit_breaker(RequestQueueRow row, CurlHandle *handle);
+
+void set_adaptive_concurrency(bool enabled, int ceiling);
+
+int concurrency_batch_size(int batch_size);
+
+bool defer_by_concurrency_limit(RequestQueueRow row, CurlHandle *handle);
+
+void adapt_concurrency_limits(void);
+
+bool serve_cached_response(RequestQueueRow row, CurlHandle *handle);
+
+int add_warm_handles(CURLM *curl_mhandle, TransferPool *pool, const char *origins);
+
+HeapTuple perform_sync_request(RequestQueueRow row, TupleDesc tupdesc);
+
+void reset_curl_handle(CurlHandle *handle);
 
 #endif
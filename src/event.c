@@ -8,7 +8,246 @@
 #include "errors.h"
 #include "event.h"
 
-#ifdef WAIT_USE_EPOLL
+#if defined(WAIT_USE_IO_URING)
+
+#  include <poll.h>
+
+// Every poll and timeout is tagged on its user_data with a generation number, so completions of
+// operations that were already replaced or removed are recognized as stale and ignored. This lets
+// us queue removals and additions without linking them or waiting for their results.
+#  define IGNORE_USER_DATA UINT64_C(0)
+#  define TIMER_TAG (UINT64_C(1) << 63)
+#  define TIMER_USER_DATA(gen) (TIMER_TAG | (uint64)(gen))
+#  define SOCKET_USER_DATA(fd, gen) (((uint64)(gen) << 32) | (uint32)(fd))
+
+typedef struct {
+  uint32 mask;  // the poll mask libcurl wants for the socket, 0 when it's not watched
+  uint32 gen;   // generation of the last armed poll
+  bool   armed; // whether a poll for the current generation is pending
+} SocketSlot;
+
+static const unsigned ring_entries = 1024;
+
+static struct io_uring          ring;
+static bool                     ring_created = false;
+static SocketSlot              *slots        = NULL; // indexed by socket fd
+static int                      nslots       = 0;
+static uint32                   timer_gen    = 0;
+static bool                     timer_armed  = false;
+static struct __kernel_timespec timer_ts;
+
+// A marker value only need to be assigned to a socket's socketp pointer via a call to
+// curl_multi_assign.
+static char socketp_marker;
+
+// SQEs are only queued here, they're all sent in one submission by wait_event. The submission queue
+// is only flushed early when it gets full.
+static struct io_uring_sqe *get_sqe(void) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe) {
+    int ret = io_uring_submit(&ring);
+    if (ret < 0) ereport(ERROR, errmsg("io_uring_submit failed: %s", strerror(-ret)));
+    sqe = io_uring_get_sqe(&ring);
+    if (!sqe) ereport(ERROR, errmsg("io_uring submission queue is full"));
+  }
+  return sqe;
+}
+
+static uint32 next_gen(uint32 gen) {
+  return gen + 1 == 0 ? 1 : gen + 1; // 0 is never used so IGNORE_USER_DATA can't match a socket
+}
+
+static SocketSlot *get_slot(curl_socket_t sockfd) {
+  if (sockfd >= nslots) {
+    int new_nslots = Max(sockfd + 1, nslots * 2);
+
+    if (slots == NULL)
+      slots = MemoryContextAllocZero(TopMemoryContext, sizeof(SocketSlot) * new_nslots);
+    else {
+      slots = repalloc(slots, sizeof(SocketSlot) * new_nslots);
+      MemSet(&slots[nslots], 0, sizeof(SocketSlot) * (new_nslots - nslots));
+    }
+
+    nslots = new_nslots;
+  }
+  return &slots[sockfd];
+}
+
+// polls are one-shot, they have to be armed again after each completion
+static void arm_poll(curl_socket_t sockfd, SocketSlot *slot) {
+  struct io_uring_sqe *sqe = get_sqe();
+  slot->gen                = next_gen(slot->gen);
+  io_uring_prep_poll_add(sqe, sockfd, slot->mask);
+  io_uring_sqe_set_data64(sqe, SOCKET_USER_DATA(sockfd, slot->gen));
+  slot->armed = true;
+}
+
+static void disarm_poll(curl_socket_t sockfd, SocketSlot *slot) {
+  if (!slot->armed) return;
+
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_poll_remove(sqe, SOCKET_USER_DATA(sockfd, slot->gen));
+  io_uring_sqe_set_data64(sqe, IGNORE_USER_DATA);
+  slot->armed = false;
+}
+
+int wait_event(__attribute__((unused)) int fd, event *events, size_t maxevents,
+               int timeout_milliseconds) {
+  struct __kernel_timespec ts = {
+    .tv_sec  = timeout_milliseconds / 1000,
+    .tv_nsec = (timeout_milliseconds % 1000) * 1000 * 1000,
+  };
+  struct io_uring_cqe *cqe = NULL;
+
+  // all the poll and timer changes queued since the last wait go out together with the wait itself
+  int ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+  if (ret < 0 && ret != -ETIME) {
+    errno = -ret;
+    return -1;
+  }
+
+  size_t   nevents = 0;
+  unsigned seen    = 0;
+  unsigned head;
+
+  io_uring_for_each_cqe(&ring, head, cqe) {
+    if (nevents == maxevents) break;
+    seen++;
+
+    uint64 user_data = io_uring_cqe_get_data64(cqe);
+
+    if (user_data == IGNORE_USER_DATA) continue;
+
+    if (user_data & TIMER_TAG) {
+      // -ECANCELED is returned for removed timers, those are ignored
+      if (timer_armed && user_data == TIMER_USER_DATA(timer_gen) && cqe->res == -ETIME) {
+        timer_armed       = false;
+        events[nevents++] = (event){.timer = true};
+      }
+      continue;
+    }
+
+    curl_socket_t sockfd = (curl_socket_t)(uint32)user_data;
+
+    if (sockfd >= nslots) continue;
+
+    SocketSlot *slot = &slots[sockfd];
+
+    if (!slot->armed || user_data != SOCKET_USER_DATA(sockfd, slot->gen)) continue;
+
+    slot->armed       = false;
+    events[nevents++] = (event){
+      .sockfd  = sockfd,
+      .revents = cqe->res < 0 ? POLLERR : (uint32)cqe->res,
+    };
+
+    arm_poll(sockfd, slot);
+  }
+
+  io_uring_cq_advance(&ring, seen);
+
+  return (int)nevents;
+}
+
+int event_monitor(void) {
+  int ret = io_uring_queue_init(ring_entries, &ring, 0);
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  ring_created = true;
+  return ring.ring_fd;
+}
+
+void ev_monitor_close(__attribute__((unused)) WorkerState *wstate) {
+  if (ring_created) io_uring_queue_exit(&ring);
+  ring_created = false;
+
+  if (slots) pfree(slots);
+  slots       = NULL;
+  nslots      = 0;
+  timer_armed = false;
+}
+
+int multi_timer_cb(__attribute__((unused)) CURLM *multi, long timeout_ms,
+                   __attribute__((unused)) void *userp) {
+  elog(DEBUG2, "multi_timer_cb: Setting timeout to %ld ms\n", timeout_ms);
+
+  if (timer_armed) {
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout_remove(sqe, TIMER_USER_DATA(timer_gen), 0);
+    io_uring_sqe_set_data64(sqe, IGNORE_USER_DATA);
+    timer_armed = false;
+  }
+
+  // libcurl passes a -1 to indicate the timer should be deleted
+  if (timeout_ms < 0) return 0;
+
+  // disable clang-format as it only hurts readability here
+  // clang-format off
+  timer_ts =
+    timeout_ms > 0 ?
+    (struct __kernel_timespec){
+      .tv_sec = timeout_ms / 1000,
+      .tv_nsec = (timeout_ms % 1000) * 1000 * 1000,
+    }:
+    // libcurl wants us to timeout now, schedule the timer to fire in 1 ns like the epoll backend
+    (struct __kernel_timespec){
+      .tv_sec = 0,
+      .tv_nsec = 1,
+    };
+  // clang-format on
+
+  // the kernel copies timer_ts when the SQE is submitted, so it has to outlive this call
+  struct io_uring_sqe *sqe = get_sqe();
+  timer_gen                = next_gen(timer_gen);
+  io_uring_prep_timeout(sqe, &timer_ts, 0, 0);
+  io_uring_sqe_set_data64(sqe, TIMER_USER_DATA(timer_gen));
+  timer_armed = true;
+
+  return 0;
+}
+
+int multi_socket_cb(__attribute__((unused)) CURL *easy, curl_socket_t sockfd, int what, void *userp,
+                    void *socketp) {
+  WorkerState *wstate     = (WorkerState *)userp;
+  static char *whatstrs[] = {"NONE", "CURL_POLL_IN", "CURL_POLL_OUT", "CURL_POLL_INOUT",
+                             "CURL_POLL_REMOVE"};
+  elog(DEBUG2, "multi_socket_cb: sockfd %d received %s", sockfd, whatstrs[what]);
+
+  SocketSlot *slot = get_slot(sockfd);
+
+  if (!socketp) EREPORT_MULTI(curl_multi_assign(wstate->curl_mhandle, sockfd, &socketp_marker));
+
+  // a pending poll can't be modified in place, so it's replaced by a new one
+  disarm_poll(sockfd, slot);
+
+  if (what == CURL_POLL_REMOVE) {
+    EREPORT_MULTI(curl_multi_assign(wstate->curl_mhandle, sockfd, NULL));
+    slot->mask = 0;
+  } else {
+    slot->mask = (what & CURL_POLL_IN ? POLLIN : 0) | (what & CURL_POLL_OUT ? POLLOUT : 0);
+    arm_poll(sockfd, slot);
+  }
+
+  return 0;
+}
+
+bool is_timer(event ev) {
+  return ev.timer;
+}
+
+int get_curl_event(event ev) {
+  int ev_bitmask = (ev.revents & POLLIN ? CURL_CSELECT_IN : 0) |
+                   (ev.revents & POLLOUT ? CURL_CSELECT_OUT : 0);
+  return ev_bitmask ? ev_bitmask : CURL_CSELECT_ERR;
+}
+
+int get_socket_fd(event ev) {
+  return ev.sockfd;
+}
+
+#elif defined(WAIT_USE_EPOLL)
 
 static int  timerfd       = 0;
 static bool timer_created = false;
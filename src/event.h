@@ -5,7 +5,9 @@
 
 #include "core.h"
 
-#ifdef __linux__
+#if defined(__linux__) && defined(PG_NET_IO_URING)
+#  define WAIT_USE_IO_URING
+#elif defined(__linux__)
 #  define WAIT_USE_EPOLL
 #elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
 #  define WAIT_USE_KQUEUE
@@ -13,7 +15,18 @@
 #  error "no event loop implementation available"
 #endif
 
-#ifdef WAIT_USE_EPOLL
+#if defined(WAIT_USE_IO_URING)
+
+#  include <liburing.h>
+
+// filled from the io_uring completions, a socket readiness or a timer expiration
+typedef struct {
+  curl_socket_t sockfd;
+  uint32        revents;
+  bool          timer;
+} event;
+
+#elif defined(WAIT_USE_EPOLL)
 
 #  include <sys/epoll.h>
 #  include <sys/timerfd.h>
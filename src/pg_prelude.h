@@ -11,6 +11,7 @@
 #include "commands/dbcommands.h"
 #include "storage/lmgr.h"
 #include <access/hash.h>
+#include <access/relation.h>
 #include <access/xact.h>
 #include <catalog/namespace.h>
 #include <catalog/pg_authid.h>
@@ -18,22 +19,28 @@
 #include <catalog/pg_type.h>
 #include <commands/defrem.h>
 #include <commands/extension.h>
+#include <executor/instrument.h>
 #include <executor/spi.h>
 #include <fmgr.h>
+#include <funcapi.h>
 #include <miscadmin.h>
 #include <nodes/makefuncs.h>
 #include <nodes/pg_list.h>
 #include <pgstat.h>
 #include <postmaster/bgworker.h>
+#include <storage/bufmgr.h>
 #include <storage/condition_variable.h>
 #include <storage/ipc.h>
 #include <storage/latch.h>
 #include <storage/proc.h>
+#include <storage/procarray.h>
 #include <storage/shmem.h>
+#include <storage/spin.h>
 #include <tcop/utility.h>
 #include <tsearch/ts_locale.h>
 #include <utils/acl.h>
 #include <utils/builtins.h>
+#include <utils/datum.h>
 #include <utils/fmgrprotos.h>
 #include <utils/guc.h>
 #include <utils/guc_tables.h>
@@ -43,7 +50,9 @@
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
 #include <utils/regproc.h>
+#include <utils/resowner.h>
 #include <utils/snapmgr.h>
+#include <utils/tuplestore.h>
 #include <utils/varlena.h>
 
 #pragma GCC diagnostic pop
@@ -51,6 +60,11 @@
 #define PG15_GTE (PG_VERSION_NUM >= 150000)
 #define PG17_LT (PG_VERSION_NUM < 170000)
 
+#if PG_VERSION_NUM < 140000
+// string keys are the default of hash_create before pg 14 added HASH_STRINGS
+#  define HASH_STRINGS 0
+#endif
+
 #if PG_VERSION_NUM >= 190000
 #  define LOG_MIN_MESSAGES *log_min_messages
 
@@ -0,0 +1,539 @@
+// The libcurl multi loops of pg_net.transfer_threads. Each thread owns a multi handle and does the
+// socket work, TLS and body buffering of the requests sent to it, so it must never call a Postgres
+// function: Postgres isn't thread safe, not even for palloc or elog. That's why this file doesn't
+// include pg_prelude.h. The worker process keeps doing everything that touches the database.
+//
+// Transfers go from the worker to a thread and back through intrusive lock-free stacks. Producers
+// push with a compare and swap and the only consumer takes the whole stack at once, so there's no
+// ABA problem to care about. A transfer is only ever in one stack, its owner at any time is
+// whoever took it last.
+// pthread_sigmask isn't part of C11
+#ifndef _POSIX_C_SOURCE
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "transfers.h"
+
+// MaxAllocSize, the worker can't hold a bigger body in a StringInfo
+#define MAX_BODY_SIZE ((size_t)0x3fffffff)
+
+// the threads wake at least this often to see if they must stop
+static const int poll_timeout_ms = 1000;
+
+static const size_t min_body_capacity = 16 * 1024;
+
+typedef struct TransferThread TransferThread;
+
+typedef enum {
+  COMMAND_ADD,
+  COMMAND_RESUME,
+} TransferCommand;
+
+typedef struct {
+  _Atomic(Transfer *) head;
+} TransferStack;
+
+struct Transfer {
+  CURL           *ez_handle;
+  void           *owner; // the worker's CurlHandle, NULL for a connection warming handle
+  TransferThread *thread;
+  char           *body; // received since the last chunk, malloc'd
+  size_t          body_len;
+  size_t          body_capacity;
+  size_t          chunk_size; // 0 when the body isn't chunked
+  TransferCommand command;    // set by the worker before pushing it to its thread
+  TransferEvent   event;      // set by the thread before handing it back
+  CURLcode        result;
+  atomic_bool     cancelled;
+  Transfer       *next; // in a TransferStack or the worker's ready list
+
+  // only used by its thread
+  bool          handed_back;    // its chunk is being written by the worker
+  bool          finished;       // it completed while its chunk was being written
+  TransferEvent finished_event; // handed back once the worker resumes it
+  Transfer     *prev_active;
+  Transfer     *next_active;
+};
+
+struct TransferThread {
+  TransferPool *pool;
+  pthread_t     id;
+  bool          started;
+  CURLM        *multi;
+  TransferStack inbox;
+  atomic_bool   cancel_pending;
+  Transfer     *active; // the transfers added to the multi handle
+};
+
+struct TransferPool {
+  int             nthreads;
+  TransferThread *threads;
+  TransferStack   outbox; // handed back to the worker
+  atomic_bool     notified;
+  atomic_bool     stopping;
+  atomic_int      failure; // the first CURLMcode a thread failed with
+  int             notify_fds[2];
+
+  // only used by the worker
+  Transfer *ready; // taken from the outbox, in the order they were handed back
+  Transfer *ready_tail;
+  int       in_flight;
+};
+
+static void push(TransferStack *stack, Transfer *transfer) {
+  Transfer *head = atomic_load_explicit(&stack->head, memory_order_relaxed);
+  do {
+    transfer->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&stack->head, &head, transfer,
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+// the transfers pushed so far, oldest first
+static Transfer *take_all(TransferStack *stack) {
+  Transfer *head     = atomic_exchange_explicit(&stack->head, NULL, memory_order_acquire);
+  Transfer *reversed = NULL;
+
+  while (head) {
+    Transfer *next = head->next;
+    head->next     = reversed;
+    reversed       = head;
+    head           = next;
+  }
+
+  return reversed;
+}
+
+// One byte on the pipe wakes the worker, it's only written again after the worker collected
+static void notify_worker(TransferPool *pool) {
+  if (!atomic_exchange(&pool->notified, true)) {
+    if (write(pool->notify_fds[1], "x", 1) < 0) {
+      // the pipe is full, so the worker gets woken anyway
+    }
+  }
+}
+
+static void hand_back(Transfer *transfer, TransferEvent event) {
+  TransferPool *pool = transfer->thread->pool;
+
+  transfer->event = event;
+  push(&pool->outbox, transfer);
+  notify_worker(pool);
+}
+
+static void fail(TransferPool *pool, CURLMcode code) {
+  int expected = CURLM_OK;
+  atomic_compare_exchange_strong(&pool->failure, &expected, (int)code);
+  notify_worker(pool);
+}
+
+static bool reserve_body(Transfer *transfer, size_t len) {
+  if (transfer->body_len + len + 1 <= transfer->body_capacity) return true;
+
+  if (transfer->body_len + len > MAX_BODY_SIZE) return false;
+
+  size_t capacity = transfer->body_capacity > 0 ? transfer->body_capacity : min_body_capacity;
+  while (capacity < transfer->body_len + len + 1)
+    capacity *= 2;
+
+  char *body = realloc(transfer->body, capacity);
+  if (body == NULL) return false;
+
+  transfer->body          = body;
+  transfer->body_capacity = capacity;
+  return true;
+}
+
+// Like body_cb in core.c. A full chunk is handed back to the worker, which writes it and resumes
+// the transfer.
+static size_t buffer_body(char *contents, size_t size, size_t nmemb, void *userp) {
+  Transfer *transfer = (Transfer *)userp;
+  size_t    realsize = size * nmemb;
+
+  if (transfer->chunk_size > 0 && transfer->body_len > 0 &&
+      transfer->body_len + realsize > transfer->chunk_size) {
+    transfer->handed_back = true;
+    hand_back(transfer, TRANSFER_CHUNK);
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  // fails the transfer with CURLE_WRITE_ERROR
+  if (!reserve_body(transfer, realsize)) return 0;
+
+  memcpy(transfer->body + transfer->body_len, contents, realsize);
+  transfer->body_len += realsize;
+  transfer->body[transfer->body_len] = '\0';
+
+  return realsize;
+}
+
+static void link_active(TransferThread *thread, Transfer *transfer) {
+  transfer->prev_active = NULL;
+  transfer->next_active = thread->active;
+  if (thread->active) thread->active->prev_active = transfer;
+  thread->active = transfer;
+}
+
+static void unlink_active(TransferThread *thread, Transfer *transfer) {
+  if (transfer->prev_active)
+    transfer->prev_active->next_active = transfer->next_active;
+  else
+    thread->active = transfer->next_active;
+
+  if (transfer->next_active) transfer->next_active->prev_active = transfer->prev_active;
+
+  transfer->prev_active = transfer->next_active = NULL;
+}
+
+// Takes the transfer out of the multi handle, giving its easy handle back to the worker. One
+// whose chunk is being written is handed back once the worker resumes it.
+static CURLMcode finish(TransferThread *thread, Transfer *transfer, TransferEvent event,
+                        CURLcode result) {
+  CURLMcode code = curl_multi_remove_handle(thread->multi, transfer->ez_handle);
+  unlink_active(thread, transfer);
+
+  transfer->result = result;
+  curl_easy_setopt(transfer->ez_handle, CURLOPT_PRIVATE, transfer->owner);
+
+  if (transfer->handed_back) {
+    transfer->finished       = true;
+    transfer->finished_event = event;
+  } else
+    hand_back(transfer, event);
+
+  return code;
+}
+
+static CURLMcode take_commands(TransferThread *thread) {
+  CURLMcode code     = CURLM_OK;
+  Transfer *transfer = take_all(&thread->inbox);
+
+  while (transfer && code == CURLM_OK) {
+    Transfer *next = transfer->next;
+
+    switch (transfer->command) {
+    case COMMAND_ADD:
+      code = curl_multi_add_handle(thread->multi, transfer->ez_handle);
+      if (code == CURLM_OK) link_active(thread, transfer);
+      break;
+    case COMMAND_RESUME:
+      transfer->handed_back = false;
+
+      if (transfer->finished)
+        hand_back(transfer, transfer->finished_event);
+      else if (atomic_load(&transfer->cancelled))
+        code = finish(thread, transfer, TRANSFER_REMOVED, CURLE_OK);
+      else {
+        // resuming delivers the data libcurl kept, which can hand the transfer back again
+        CURLcode result = curl_easy_pause(transfer->ez_handle, CURLPAUSE_CONT);
+        if (result != CURLE_OK) code = finish(thread, transfer, TRANSFER_DONE, result);
+      }
+      break;
+    }
+
+    transfer = next;
+  }
+
+  return code;
+}
+
+static CURLMcode remove_cancelled(TransferThread *thread) {
+  CURLMcode code     = CURLM_OK;
+  Transfer *transfer = thread->active;
+
+  while (transfer && code == CURLM_OK) {
+    Transfer *next = transfer->next_active;
+
+    // a transfer whose chunk is being written is removed when it's resumed
+    if (atomic_load(&transfer->cancelled) && !transfer->handed_back)
+      code = finish(thread, transfer, TRANSFER_REMOVED, CURLE_OK);
+
+    transfer = next;
+  }
+
+  return code;
+}
+
+static CURLMcode hand_back_completed(TransferThread *thread) {
+  CURLMcode code      = CURLM_OK;
+  CURLMsg  *msg       = NULL;
+  int       msgs_left = 0;
+
+  while (code == CURLM_OK && (msg = curl_multi_info_read(thread->multi, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE) continue;
+
+    char *transfer = NULL;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+
+    code = finish(thread, (Transfer *)transfer, TRANSFER_DONE, msg->data.result);
+  }
+
+  return code;
+}
+
+static void *run_thread(void *arg) {
+  TransferThread *thread = (TransferThread *)arg;
+  CURLMcode       code   = CURLM_OK;
+
+  while (code == CURLM_OK && !atomic_load(&thread->pool->stopping)) {
+    int running_handles;
+
+    code = take_commands(thread);
+
+    if (code == CURLM_OK && atomic_exchange(&thread->cancel_pending, false))
+      code = remove_cancelled(thread);
+
+    if (code == CURLM_OK) code = curl_multi_perform(thread->multi, &running_handles);
+
+    if (code == CURLM_OK) code = hand_back_completed(thread);
+
+    // curl_multi_wakeup interrupts it when there's a command
+    if (code == CURLM_OK) code = curl_multi_poll(thread->multi, NULL, 0, poll_timeout_ms, NULL);
+  }
+
+  if (code != CURLM_OK) fail(thread->pool, code);
+
+  // the worker cleans up the easy handles once the threads are joined
+  for (Transfer *transfer = thread->active; transfer; transfer = transfer->next_active)
+    curl_multi_remove_handle(thread->multi, transfer->ez_handle);
+
+  return NULL;
+}
+
+static bool set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0 &&
+         fcntl(fd, F_SETFD, FD_CLOEXEC) >= 0;
+}
+
+// Starts the threads, returns NULL with errno set when they can't be started. libcurl must be
+// initialized already.
+TransferPool *transfer_pool_start(int nthreads) {
+  TransferPool *pool = calloc(1, sizeof(TransferPool));
+  if (pool == NULL) return NULL;
+
+  pool->notify_fds[0] = pool->notify_fds[1] = -1;
+  pool->nthreads                            = nthreads;
+  pool->threads                             = calloc(nthreads, sizeof(TransferThread));
+  atomic_init(&pool->outbox.head, NULL);
+  atomic_init(&pool->notified, false);
+  atomic_init(&pool->stopping, false);
+  atomic_init(&pool->failure, CURLM_OK);
+
+  if (pool->threads == NULL || pipe(pool->notify_fds) < 0 ||
+      !set_nonblocking(pool->notify_fds[0]) || !set_nonblocking(pool->notify_fds[1])) {
+    int save_errno = errno;
+    transfer_pool_stop(pool);
+    errno = save_errno;
+    return NULL;
+  }
+
+  // the signals are handled by the worker's own thread, its handlers aren't thread safe
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+  int error = 0;
+
+  for (int i = 0; i < nthreads && error == 0; i++) {
+    TransferThread *thread = &pool->threads[i];
+
+    thread->pool  = pool;
+    thread->multi = curl_multi_init();
+    atomic_init(&thread->inbox.head, NULL);
+    atomic_init(&thread->cancel_pending, false);
+
+    if (thread->multi == NULL)
+      error = ENOMEM;
+    else
+      error = pthread_create(&thread->id, NULL, run_thread, thread);
+
+    thread->started = error == 0;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  if (error != 0) {
+    transfer_pool_stop(pool);
+    errno = error;
+    return NULL;
+  }
+
+  return pool;
+}
+
+// Stops and joins the threads. Only done when the worker exits, so the transfers still in flight
+// are left to the process exit, their easy handles are cleaned up by the worker.
+void transfer_pool_stop(TransferPool *pool) {
+  atomic_store(&pool->stopping, true);
+
+  for (int i = 0; pool->threads && i < pool->nthreads; i++) {
+    TransferThread *thread = &pool->threads[i];
+
+    if (thread->started) {
+      curl_multi_wakeup(thread->multi);
+      pthread_join(thread->id, NULL);
+    }
+
+    if (thread->multi) curl_multi_cleanup(thread->multi);
+  }
+
+  if (pool->notify_fds[0] >= 0) close(pool->notify_fds[0]);
+  if (pool->notify_fds[1] >= 0) close(pool->notify_fds[1]);
+
+  free(pool->threads);
+  free(pool);
+}
+
+// readable when transfers were handed back, see transfer_pool_collect
+int transfer_pool_notify_fd(const TransferPool *pool) {
+  return pool->notify_fds[0];
+}
+
+// the transfers submitted that weren't handed back as done or removed yet
+int transfer_pool_in_flight(const TransferPool *pool) {
+  return pool->in_flight;
+}
+
+static uint32_t hash_host(const char *url) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  CURLU   *h    = curl_url();
+  char    *host = NULL;
+
+  if (h && curl_url_set(h, CURLUPART_URL, url, 0) == CURLUE_OK &&
+      curl_url_get(h, CURLUPART_HOST, &host, 0) == CURLUE_OK) {
+    for (const char *c = host; *c; c++)
+      hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+
+  curl_free(host);
+  curl_url_cleanup(h);
+
+  return hash;
+}
+
+// Sends the easy handle from one of the threads, the requests to the same host always go to the
+// same thread so they share its connections. Its write callback and private pointer belong to the
+// transfer until it's handed back. Returns NULL when out of memory.
+Transfer *transfer_pool_submit(TransferPool *pool, CURL *ez_handle, void *owner, const char *url,
+                               size_t chunk_size) {
+  Transfer *transfer = calloc(1, sizeof(Transfer));
+  if (transfer == NULL) return NULL;
+
+  transfer->ez_handle  = ez_handle;
+  transfer->owner      = owner;
+  transfer->chunk_size = chunk_size;
+  transfer->command    = COMMAND_ADD;
+  transfer->thread     = &pool->threads[pool->nthreads > 1 ? hash_host(url) % pool->nthreads : 0];
+  atomic_init(&transfer->cancelled, false);
+
+  // libcurl can't use signals for its timeouts in a threaded program
+  if (curl_easy_setopt(ez_handle, CURLOPT_NOSIGNAL, 1L) != CURLE_OK ||
+      curl_easy_setopt(ez_handle, CURLOPT_WRITEFUNCTION, buffer_body) != CURLE_OK ||
+      curl_easy_setopt(ez_handle, CURLOPT_WRITEDATA, transfer) != CURLE_OK ||
+      curl_easy_setopt(ez_handle, CURLOPT_PRIVATE, transfer) != CURLE_OK) {
+    free(transfer);
+    return NULL;
+  }
+
+  pool->in_flight++;
+
+  push(&transfer->thread->inbox, transfer);
+  curl_multi_wakeup(transfer->thread->multi);
+
+  return transfer;
+}
+
+// Takes the transfers handed back since the last call, returns the CURLMcode of a failed thread
+CURLMcode transfer_pool_collect(TransferPool *pool) {
+  char buf[64];
+  while (read(pool->notify_fds[0], buf, sizeof(buf)) > 0) {
+  }
+
+  // cleared after draining the pipe and before taking the outbox, so a transfer handed back from
+  // now on writes to the pipe again and the write isn't lost
+  atomic_store(&pool->notified, false);
+
+  Transfer *taken = take_all(&pool->outbox);
+
+  if (taken) {
+    if (pool->ready_tail)
+      pool->ready_tail->next = taken;
+    else
+      pool->ready = taken;
+
+    while (taken->next)
+      taken = taken->next;
+    pool->ready_tail = taken;
+  }
+
+  return (CURLMcode)atomic_load(&pool->failure);
+}
+
+// the next transfer collected, NULL when there's none
+Transfer *transfer_pool_next(TransferPool *pool) {
+  Transfer *transfer = pool->ready;
+  if (transfer == NULL) return NULL;
+
+  pool->ready = transfer->next;
+  if (pool->ready == NULL) pool->ready_tail = NULL;
+  transfer->next = NULL;
+
+  if (transfer->event != TRANSFER_CHUNK) pool->in_flight--;
+
+  return transfer;
+}
+
+// continues a transfer handed back with a chunk, once the chunk was written
+void transfer_resume(Transfer *transfer) {
+  transfer->body_len = 0;
+  transfer->command  = COMMAND_RESUME;
+
+  push(&transfer->thread->inbox, transfer);
+  curl_multi_wakeup(transfer->thread->multi);
+}
+
+// The transfer is handed back as removed, unless it's done already
+void transfer_cancel(Transfer *transfer) {
+  atomic_store(&transfer->cancelled, true);
+  atomic_store(&transfer->thread->cancel_pending, true);
+  curl_multi_wakeup(transfer->thread->multi);
+}
+
+// only for the transfers handed back as done or removed
+void transfer_free(Transfer *transfer) {
+  free(transfer->body);
+  free(transfer);
+}
+
+TransferEvent transfer_event(const Transfer *transfer) {
+  return transfer->event;
+}
+
+CURLcode transfer_result(const Transfer *transfer) {
+  return transfer->result;
+}
+
+void *transfer_owner(const Transfer *transfer) {
+  return transfer->owner;
+}
+
+CURL *transfer_ez_handle(const Transfer *transfer) {
+  return transfer->ez_handle;
+}
+
+// the body received since the last chunk
+const char *transfer_body(const Transfer *transfer, size_t *len) {
+  *len = transfer->body_len;
+  return transfer->body;
+}
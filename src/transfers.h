@@ -0,0 +1,52 @@
+#ifndef TRANSFERS_H
+#define TRANSFERS_H
+
+#include <stddef.h>
+
+#include "curl_prelude.h"
+
+// Why a transfer thread handed a transfer back to the worker
+typedef enum {
+  TRANSFER_DONE,    // it completed, successfully or not, see transfer_result
+  TRANSFER_CHUNK,   // it's paused with a full body chunk until transfer_resume
+  TRANSFER_REMOVED, // it was stopped by transfer_cancel
+} TransferEvent;
+
+// The threads sending requests when pg_net.transfer_threads is set, see transfers.c
+typedef struct TransferPool TransferPool;
+
+// A request being sent by a transfer thread
+typedef struct Transfer Transfer;
+
+TransferPool *transfer_pool_start(int nthreads);
+
+void transfer_pool_stop(TransferPool *pool);
+
+int transfer_pool_notify_fd(const TransferPool *pool);
+
+int transfer_pool_in_flight(const TransferPool *pool);
+
+Transfer *transfer_pool_submit(TransferPool *pool, CURL *ez_handle, void *owner, const char *url,
+                               size_t chunk_size);
+
+CURLMcode transfer_pool_collect(TransferPool *pool);
+
+Transfer *transfer_pool_next(TransferPool *pool);
+
+void transfer_resume(Transfer *transfer);
+
+void transfer_cancel(Transfer *transfer);
+
+void transfer_free(Transfer *transfer);
+
+TransferEvent transfer_event(const Transfer *transfer);
+
+CURLcode transfer_result(const Transfer *transfer);
+
+void *transfer_owner(const Transfer *transfer);
+
+CURL *transfer_ez_handle(const Transfer *transfer);
+
+const char *transfer_body(const Transfer *transfer, size_t *len);
+
+#endif
@@ -28,21 +28,95 @@ PG_MODULE_MAGIC;
 typedef enum {
   WORKER_WAIT_NO_TIMEOUT,
   WORKER_WAIT_ONE_SECOND,
+  WORKER_WAIT_WARM_INTERVAL,
+  WORKER_WAIT_LAUNCH_INTERVAL,
 } WorkerWait;
 
-static WorkerState *worker_state = NULL;
+// shared state of the workers, one slot per database served. The first slot belongs to the worker
+// registered at startup for pg_net.database_name, the others to workers launched dynamically
+typedef struct {
+  slock_t          mutex;              // protects the assignment of slots to databases
+  bool             slots_full_warned;  // until a slot is released, see get_database_worker
+  pg_atomic_uint32 probe_found_no_ext; // set by the probe of launch_database_workers
+  WorkerState      workers[FLEXIBLE_ARRAY_MEMBER];
+} NetShmem;
+
+static NetShmem    *net_shmem         = NULL;
+static WorkerState *worker_state      = NULL; // the slot of the running worker
+static WorkerState *wake_worker_state = NULL; // the worker to wake at commit
 
 static const int    curl_handle_event_timeout_ms = 1000;
+static const int    max_events                   = 1024;
+// below libcurl's default of 118 seconds for closing idle connections
+static const int    warm_interval_ms             = 60 * 1000;
+static TimestampTz  last_warm_time               = 0;
+// how often the primary worker relaunches the dynamic workers that died
+static const int    launch_interval_ms           = 10 * 1000;
+static TimestampTz  last_launch_time             = 0;
+static List        *databases_without_ext        = NIL; // never probed again, see probe_database
 static const int    net_worker_restart_time_sec  = 1;
 static const long   no_timeout                   = -1L;
+// how often a backend blocked by a full queue checks it again
+static const long   queue_poll_ms                = 10;
 static bool         wake_commit_cb_active        = false;
+static uint64       cancelled_at_commit          = 0; // see net._cancel_at_commit
+static uint64       admitted_at_commit           = 0; // see net._admit_request
+static bool         templates_changed_at_commit  = false;
+static uint32       templates_generation         = 0; // of the templates cached by the worker
 static bool         worker_should_restart        = false;
 static const size_t total_extension_tables       = 2;
+static const int    primary_worker_slot          = 0;
+static int          worker_slot                  = 0;
+static bool         worker_relaunched            = false;
+static bool         worker_cleaned_up            = false;
+
+// per batch allocations go here and are freed in one go when the batch is done
+static MemoryContext batch_context = NULL;
+// curl handles are kept between batches to avoid recreating them for every request
+static CurlHandle *handle_slots     = NULL;
+static size_t      handle_slots_len = 0;
+static event      *events           = NULL;
+// sends the requests when pg_net.transfer_threads is set, see run_threaded_transfers
+static TransferPool *transfer_pool = NULL;
 
 static char *guc_ttl;
 static int   guc_batch_size;
 static char *guc_database_name;
 static char *guc_username;
+static int   guc_max_databases;
+static char *guc_warm_origins;
+static char *guc_proxy;
+static bool  guc_coalesce_gets;
+static char *guc_unix_sockets;
+static int   guc_cache_size;
+static int   guc_circuit_breaker_failures;
+static int   guc_circuit_breaker_cooldown;
+static int   guc_body_chunk_size;
+static int   guc_aggregate_max_requests;
+static int   guc_aggregate_max_size;
+static int   guc_queue_max_depth;
+static int   guc_queue_full_policy;
+static int   guc_queue_block_timeout;
+static int   guc_tenant_max_in_flight;
+static char *guc_tenant;
+static bool  guc_adaptive_concurrency;
+static int   guc_transfer_threads;
+
+typedef enum {
+  QUEUE_FULL_REJECT,
+  QUEUE_FULL_BLOCK,
+  QUEUE_FULL_DROP,
+} QueueFullPolicy;
+
+static const struct config_enum_entry queue_full_policies[] = {
+  {"reject", QUEUE_FULL_REJECT, false},
+  {"block", QUEUE_FULL_BLOCK, false},
+  {"drop", QUEUE_FULL_DROP, false},
+  {NULL, 0, false},
+};
+
+static bool  guc_tracing;
+static char *guc_traceparent;
 
 #if PG15_GTE
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
@@ -55,16 +129,174 @@ void _PG_init(void);
 
 #if PG_VERSION_NUM >= 180000
 PGDLLEXPORT pg_noreturn void pg_net_worker(Datum main_arg);
+PGDLLEXPORT pg_noreturn void pg_net_probe(Datum main_arg);
 #else
 PGDLLEXPORT void pg_net_worker(Datum main_arg) pg_attribute_noreturn();
+PGDLLEXPORT void pg_net_probe(Datum main_arg) pg_attribute_noreturn();
 #endif
 
+static const char *const phase_names[WORKER_PHASE_COUNT] = {
+  [PHASE_EXPIRE] = "expire", [PHASE_DEQUEUE] = "dequeue", [PHASE_INIT] = "init",
+  [PHASE_TRANSFER] = "transfer", [PHASE_INSERT] = "insert", [PHASE_COMMIT] = "commit",
+};
+
+static void reset_profile(WorkerState *ws) {
+  for (int i = 0; i < WORKER_PHASE_COUNT; i++) {
+    pg_atomic_write_u64(&ws->profile[i].calls, 0);
+    pg_atomic_write_u64(&ws->profile[i].total_us, 0);
+    pg_atomic_write_u64(&ws->profile[i].max_us, 0);
+  }
+}
+
+static uint64 elapsed_us(instr_time start) {
+  instr_time duration;
+  INSTR_TIME_SET_CURRENT(duration);
+  INSTR_TIME_SUBTRACT(duration, start);
+  return INSTR_TIME_GET_MICROSEC(duration);
+}
+
+static void record_phase(WorkerPhase phase, uint64 us) {
+  PhaseProfile *profile = &worker_state->profile[phase];
+
+  pg_atomic_fetch_add_u64(&profile->calls, 1);
+  pg_atomic_fetch_add_u64(&profile->total_us, us);
+
+  uint64 max = pg_atomic_read_u64(&profile->max_us);
+  while (us > max && !pg_atomic_compare_exchange_u64(&profile->max_us, &max, us)) {
+  }
+}
+
+// the state left on a slot by its previous worker, reset once the slot is claimed and before its
+// new worker is launched
+static void reset_worker_state(WorkerState *ws) {
+  pg_atomic_write_u32(&ws->got_restart, 0);
+  pg_atomic_write_u32(&ws->got_cancel, 0);
+  pg_atomic_write_u32(&ws->templates_generation, 0);
+  pg_atomic_write_u32(&ws->should_wake, 1);
+  ws->shared_latch = NULL;
+  ws->epfd         = -1;
+  ws->curl_mhandle = NULL;
+  reset_profile(ws);
+  pg_atomic_write_u64(&ws->queue_depth, 0);
+}
+
+static void release_worker_slot(WorkerState *ws) {
+  SpinLockAcquire(&net_shmem->mutex);
+  ws->database_oid             = InvalidOid;
+  net_shmem->slots_full_warned = false;
+  SpinLockRelease(&net_shmem->mutex);
+}
+
+static bool register_database_worker(int slot, const char *database_name) {
+  BackgroundWorker worker = {
+    .bgw_flags         = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION,
+    .bgw_start_time    = BgWorkerStart_RecoveryFinished,
+    .bgw_library_name  = "pg_net",
+    .bgw_function_name = "pg_net_worker",
+    .bgw_name          = "pg_net " EXTVERSION " worker",
+    .bgw_restart_time  = BGW_NEVER_RESTART, // they relaunch themselves, see pg_net_worker
+    .bgw_main_arg      = Int32GetDatum(slot),
+  };
+  strlcpy(worker.bgw_extra, database_name, BGW_EXTRALEN);
+
+  return RegisterDynamicBackgroundWorker(&worker, NULL);
+}
+
+// Whether the worker of a claimed slot is gone without releasing it: it never started after being
+// launched, or its process isn't there anymore. Reads the slot without its lock, a slot found gone
+// is only launched again if it wasn't claimed meanwhile, see get_database_worker.
+static bool is_worker_gone(WorkerState *ws) {
+  if (pg_atomic_read_u32(&ws->status) == WS_NOT_YET)
+    return TimestampDifferenceExceeds(ws->claimed_at, GetCurrentTimestamp(), launch_interval_ms);
+
+  int pid = ws->pid;
+  return pid == 0 || BackendPidGetProc(pid) == NULL;
+}
+
+// get the dynamic worker serving a database, optionally claiming a free slot and launching it when
+// there's none, or launching it again on its slot when it's gone. Running out of slots is only
+// warned about once until a slot is released.
+static WorkerState *get_database_worker(Oid database_oid, const char *database_name, bool launch) {
+  WorkerState *ws        = NULL;
+  int          free_slot = -1;
+  bool         warn      = false;
+  TimestampTz  now       = GetCurrentTimestamp();
+
+  SpinLockAcquire(&net_shmem->mutex);
+  for (int i = primary_worker_slot + 1; i < guc_max_databases; i++) {
+    if (net_shmem->workers[i].database_oid == database_oid) {
+      ws = &net_shmem->workers[i];
+      break;
+    }
+    if (free_slot < 0 && net_shmem->workers[i].database_oid == InvalidOid) free_slot = i;
+  }
+  bool should_launch = ws == NULL && launch && free_slot > 0;
+  if (should_launch) {
+    ws               = &net_shmem->workers[free_slot];
+    ws->database_oid = database_oid;
+    ws->claimed_at   = now;
+    pg_atomic_write_u32(&ws->status, WS_NOT_YET);
+  } else if (ws == NULL && launch) {
+    warn                         = !net_shmem->slots_full_warned;
+    net_shmem->slots_full_warned = true;
+  }
+  TimestampTz claimed_at = ws ? ws->claimed_at : 0;
+  SpinLockRelease(&net_shmem->mutex);
+
+  // only one backend claims the slot again, the first one to find it as it was
+  if (ws && !should_launch && launch && is_worker_gone(ws)) {
+    SpinLockAcquire(&net_shmem->mutex);
+    should_launch = ws->database_oid == database_oid && ws->claimed_at == claimed_at;
+    if (should_launch) {
+      ws->claimed_at = now;
+      pg_atomic_write_u32(&ws->status, WS_NOT_YET);
+    }
+    SpinLockRelease(&net_shmem->mutex);
+
+    if (should_launch)
+      elog(LOG, "pg_net worker for database \"%s\" is gone, launching it again", database_name);
+  }
+
+  if (warn)
+    ereport(WARNING, errmsg("no pg_net worker slot available for database \"%s\"", database_name),
+            errhint("Increase pg_net.max_databases."));
+
+  if (should_launch) reset_worker_state(ws);
+
+  if (should_launch && !register_database_worker((int)(ws - net_shmem->workers), database_name)) {
+    release_worker_slot(ws);
+    ereport(WARNING,
+            errmsg("could not launch the pg_net worker for database \"%s\"", database_name),
+            errhint("Consider increasing max_worker_processes."));
+    return NULL;
+  }
+
+  return ws;
+}
+
+// the worker serving the database of the current backend
+static WorkerState *get_worker_state(bool launch) {
+  WorkerState *primary = &net_shmem->workers[primary_worker_slot];
+
+  if (guc_max_databases == 1) return primary;
+
+  char *database_name = get_database_name(MyDatabaseId);
+
+  if (database_name == NULL || strcmp(database_name, guc_database_name) == 0) return primary;
+
+  return get_database_worker(MyDatabaseId, database_name, launch);
+}
+
 PG_FUNCTION_INFO_V1(worker_restart);
 Datum worker_restart(__attribute__((unused)) PG_FUNCTION_ARGS) {
   bool result = DatumGetBool(DirectFunctionCall1(pg_reload_conf, (Datum)NULL)); // reload the config
-  pg_atomic_write_u32(&worker_state->got_restart, 1);
-  pg_write_barrier();
-  if (worker_state->shared_latch) SetLatch(worker_state->shared_latch);
+
+  WorkerState *ws = get_worker_state(false);
+  if (ws) {
+    pg_atomic_write_u32(&ws->got_restart, 1);
+    pg_write_barrier();
+    if (ws->shared_latch) SetLatch(ws->shared_latch);
+  }
   PG_RETURN_BOOL(result); // TODO is not necessary to return a bool here, but we do it to maintain
                           // backward compatibility
 }
@@ -83,11 +315,20 @@ static void wait_until_state(WorkerState *ws, WorkerStatus expected_status) {
 
 PG_FUNCTION_INFO_V1(wait_until_running);
 Datum wait_until_running(__attribute__((unused)) PG_FUNCTION_ARGS) {
-  wait_until_state(worker_state, WS_RUNNING);
+  WorkerState *ws = get_worker_state(true);
+  if (ws) wait_until_state(ws, WS_RUNNING);
 
   PG_RETURN_VOID();
 }
 
+// the requests left the queue, the depth can be off so it doesn't go below zero
+static void release_queue_depth(WorkerState *ws, uint64 count) {
+  uint64 depth = pg_atomic_read_u64(&ws->queue_depth);
+  while (!pg_atomic_compare_exchange_u64(&ws->queue_depth, &depth,
+                                         depth > count ? depth - count : 0)) {
+  }
+}
+
 // only wake at commit time to prevent excessive and unnecessary wakes.
 // e.g only one wake when doing `select
 // net.http_get('http://localhost:8080/pathological?status=200') from generate_series(1,100000);`
@@ -95,16 +336,42 @@ static void wake_at_commit(XactEvent event, __attribute__((unused)) void *arg) {
   elog(DEBUG2, "pg_net xact callback received: %s", xact_event_name(event));
 
   switch (event) {
+  // the worker resets its cached templates when it sees a new generation. It's bumped before the
+  // changed templates are visible, so a batch that can see them always resets, and again after, so
+  // a batch that reset too soon and cached them as they were resets once more.
+  case XACT_EVENT_PRE_COMMIT:
+  case XACT_EVENT_PARALLEL_PRE_COMMIT:
+    if (wake_commit_cb_active && templates_changed_at_commit)
+      pg_atomic_fetch_add_u32(&wake_worker_state->templates_generation, 1);
+    break;
   case XACT_EVENT_COMMIT:
   case XACT_EVENT_PARALLEL_COMMIT:
     if (wake_commit_cb_active) {
+      if (templates_changed_at_commit) {
+        pg_atomic_fetch_add_u32(&wake_worker_state->templates_generation, 1);
+        templates_changed_at_commit = false;
+      }
+
+      if (admitted_at_commit > 0) {
+        pg_atomic_fetch_add_u64(&wake_worker_state->queue_depth, admitted_at_commit);
+        admitted_at_commit = 0;
+      }
+
+      if (cancelled_at_commit > 0) {
+        pg_atomic_write_u32(&wake_worker_state->got_cancel, 1);
+        release_queue_depth(wake_worker_state, cancelled_at_commit);
+        cancelled_at_commit = 0;
+      }
+
+      // the worker is woken once everything it should see is set
       uint32 expected = 0;
-      bool   success  = pg_atomic_compare_exchange_u32(&worker_state->should_wake, &expected, 1);
+      bool success = pg_atomic_compare_exchange_u32(&wake_worker_state->should_wake, &expected, 1);
       pg_write_barrier();
 
-      if (success) // only wake the worker on first put, so if many concurrent wakes come we only
-                   // wake once
-        SetLatch(worker_state->shared_latch);
+      Latch *latch = wake_worker_state->shared_latch;
+      if (success && latch) // only wake the worker on first put, so if many concurrent wakes come
+                            // we only wake once
+        SetLatch(latch);
 
       wake_commit_cb_active = false;
     }
@@ -116,21 +383,205 @@ static void wake_at_commit(XactEvent event, __attribute__((unused)) void *arg) {
   case XACT_EVENT_PREPARE:
   // abort the callback on rollback
   case XACT_EVENT_ABORT:
-  case XACT_EVENT_PARALLEL_ABORT: wake_commit_cb_active = false; break;
+  case XACT_EVENT_PARALLEL_ABORT:
+    wake_commit_cb_active       = false;
+    cancelled_at_commit         = 0;
+    admitted_at_commit          = 0;
+    templates_changed_at_commit = false;
+    break;
   default                       : break;
   }
 }
 
+static void register_wake_at_commit(void) {
+  if (!wake_commit_cb_active) { // register only one callback per transaction
+    wake_worker_state = get_worker_state(true);
+    if (wake_worker_state) {
+      RegisterXactCallback(wake_at_commit, NULL);
+      wake_commit_cb_active = true;
+    }
+  }
+}
+
 PG_FUNCTION_INFO_V1(wake);
 Datum wake(__attribute__((unused)) PG_FUNCTION_ARGS) {
-  if (!wake_commit_cb_active) { // register only one callback per transaction
-    RegisterXactCallback(wake_at_commit, NULL);
-    wake_commit_cb_active = true;
+  register_wake_at_commit();
+
+  PG_RETURN_VOID();
+}
+
+// Called by net.cancel once it deleted the queue rows of the cancelled requests. When the
+// transaction commits, the worker is told to stop the transfers left without queue rows.
+PG_FUNCTION_INFO_V1(_cancel_at_commit);
+Datum _cancel_at_commit(PG_FUNCTION_ARGS) {
+  int64 count = PG_GETARG_INT64(0);
+
+  register_wake_at_commit();
+  if (wake_commit_cb_active && count > 0) cancelled_at_commit += count;
+
+  PG_RETURN_VOID();
+}
+
+// The approximate depth can only be too high when requests were rolled back in subtransactions.
+// The worker is woken so it starts it over from what it finds queued, see pg_net_worker.
+static void recount_queue_depth(WorkerState *ws) {
+  pg_atomic_write_u32(&ws->should_wake, 1);
+  pg_write_barrier();
+
+  Latch *latch = ws->shared_latch;
+  if (latch) SetLatch(latch);
+}
+
+static uint64 queue_depth(WorkerState *ws) {
+  return pg_atomic_read_u64(&ws->queue_depth) + admitted_at_commit;
+}
+
+static void report_queue_full(WorkerState *ws) {
+  recount_queue_depth(ws);
+
+  ereport(ERROR,
+          errmsg("pg_net request queue is full with about " UINT64_FORMAT " requests",
+                 queue_depth(ws)),
+          errhint("Retry later or increase pg_net.queue_max_depth."));
+}
+
+static void wait_for_queue_room(WorkerState *ws) {
+  TimestampTz deadline =
+      TimestampTzPlusMilliseconds(GetCurrentTimestamp(), guc_queue_block_timeout);
+
+  recount_queue_depth(ws);
+
+  while (queue_depth(ws) >= (uint64)guc_queue_max_depth) {
+    if (GetCurrentTimestamp() >= deadline) report_queue_full(ws);
+
+    WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, queue_poll_ms,
+              PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    CHECK_FOR_INTERRUPTS();
   }
+}
+
+// Called by net.prepare_request, the worker forgets the templates it cached once the transaction
+// commits
+PG_FUNCTION_INFO_V1(_request_templates_changed);
+Datum _request_templates_changed(__attribute__((unused)) PG_FUNCTION_ARGS) {
+  register_wake_at_commit();
+  if (wake_commit_cb_active) templates_changed_at_commit = true;
 
   PG_RETURN_VOID();
 }
 
+// Counts a request being enqueued in the approximate depth of the queue once the transaction
+// commits, the worker takes the requests that got their response out of it. When the queue has
+// pg_net.queue_max_depth requests, pg_net.queue_full_policy either rejects the new one, waits up
+// to pg_net.queue_block_timeout for the worker to make room, or drops a tenth of the maximum from
+// the queued requests with a lower priority, rejecting the new one when there are none.
+PG_FUNCTION_INFO_V1(_admit_request);
+Datum _admit_request(PG_FUNCTION_ARGS) {
+  int32 priority = PG_GETARG_INT32(0);
+
+  register_wake_at_commit();
+
+  WorkerState *ws = wake_worker_state;
+  if (!wake_commit_cb_active || ws == NULL) PG_RETURN_VOID();
+
+  if (guc_queue_max_depth > 0 && queue_depth(ws) >= (uint64)guc_queue_max_depth) {
+    switch (guc_queue_full_policy) {
+    case QUEUE_FULL_BLOCK:
+      wait_for_queue_room(ws);
+      break;
+    case QUEUE_FULL_DROP: {
+      uint64 dropped = drop_queued_requests(priority, Max(1, guc_queue_max_depth / 10));
+      if (dropped == 0) report_queue_full(ws);
+      // like net.cancel, the depth goes down and the transfers of the dropped requests are
+      // stopped only once the transaction commits
+      cancelled_at_commit += dropped;
+      break;
+    }
+    default:
+      report_queue_full(ws);
+    }
+  }
+
+  admitted_at_commit++;
+
+  PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(worker_profile);
+Datum worker_profile(PG_FUNCTION_ARGS) {
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+  bool           reset  = PG_GETARG_BOOL(0);
+  TupleDesc      tupdesc;
+
+  if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+      !(rsinfo->allowedModes & SFRM_Materialize))
+    ereport(ERROR, errmsg("worker_profile must be called in a context that accepts a set"));
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    ereport(ERROR, errmsg("worker_profile must return a composite type"));
+
+  MemoryContext    old_context = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+  Tuplestorestate *tupstore    = tuplestore_begin_heap(true, false, work_mem);
+  rsinfo->returnMode           = SFRM_Materialize;
+  rsinfo->setResult            = tupstore;
+  rsinfo->setDesc              = CreateTupleDescCopy(tupdesc);
+  MemoryContextSwitchTo(old_context);
+
+  WorkerState *ws = get_worker_state(false);
+  if (ws == NULL) return (Datum)0;
+
+  for (int i = 0; i < WORKER_PHASE_COUNT; i++) {
+    PhaseProfile *profile = &ws->profile[i];
+
+    Datum values[4] = {
+      CStringGetTextDatum(phase_names[i]),
+      Int64GetDatum((int64)pg_atomic_read_u64(&profile->calls)),
+      Float8GetDatum(pg_atomic_read_u64(&profile->total_us) / 1000.0),
+      Float8GetDatum(pg_atomic_read_u64(&profile->max_us) / 1000.0),
+    };
+    bool nulls[4] = {false, false, false, false};
+
+    tuplestore_putvalues(tupstore, rsinfo->setDesc, values, nulls);
+  }
+
+  if (reset) reset_profile(ws);
+
+  return (Datum)0;
+}
+
+PG_FUNCTION_INFO_V1(_http_request_sync);
+Datum _http_request_sync(PG_FUNCTION_ARGS) {
+  TupleDesc tupdesc;
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    ereport(ERROR, errmsg("_http_request_sync must return a composite type"));
+
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(4))
+    ereport(ERROR, errmsg("method, url and timeout_milliseconds cannot be null"));
+
+  RequestQueueRow row = {
+    .method               = PG_GETARG_DATUM(0),
+    .url                  = PG_GETARG_DATUM(1),
+    .timeout_milliseconds = PG_GETARG_INT32(4),
+    .headersBin           = {.isnull = PG_ARGISNULL(2)},
+    .bodyBin              = {.isnull = PG_ARGISNULL(3)},
+    .extractBin           = {.isnull = true},
+    .traceparentBin       = {.isnull = true},
+    .enqueuedAtBin        = {.isnull = true},
+    .aggregateKeyBin      = {.isnull = true},
+    .templateBin          = {.isnull = true},
+    .paramsBin            = {.isnull = true},
+  };
+  if (!row.headersBin.isnull) row.headersBin.value = PG_GETARG_DATUM(2);
+  if (!row.bodyBin.isnull) row.bodyBin.value = PG_GETARG_DATUM(3);
+
+  // the backend sends the request the same way the worker would
+  set_transport_config(guc_proxy, guc_unix_sockets);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(perform_sync_request(row, BlessTupleDesc(tupdesc))));
+}
+
 static void handle_sigterm(PG_SIGNAL_PARAMS) {
   int save_errno = errno;
   pg_atomic_write_u32(&worker_state->got_restart, 1);
@@ -166,16 +617,143 @@ static void publish_state(WorkerStatus s) {
 }
 
 static void net_on_exit(__attribute__((unused)) int code, __attribute__((unused)) Datum arg) {
+  if (worker_cleaned_up) return; // a relaunched dynamic worker already did this, see pg_net_worker
+  worker_cleaned_up = true;
+
   worker_should_restart = false;
   pg_atomic_write_u32(&worker_state->should_wake,
                       1); // ensure the remaining work will continue since we'll restart
 
   worker_state->shared_latch = NULL;
+  worker_state->pid          = 0;
 
   ev_monitor_close(worker_state);
 
+  // the threads give the easy handles back before they're cleaned up
+  if (transfer_pool) transfer_pool_stop(transfer_pool);
+  transfer_pool = NULL;
+
+  for (size_t i = 0; i < handle_slots_len; i++)
+    curl_easy_cleanup(handle_slots[i].ez_handle);
+
   curl_multi_cleanup(worker_state->curl_mhandle);
   curl_global_cleanup();
+
+  // a dynamic worker that exits without a replacement frees its slot, the next net.wake() on its
+  // database will launch it again
+  if (worker_slot != primary_worker_slot && !worker_relaunched) release_worker_slot(worker_state);
+}
+
+static CurlHandle *get_handle_slots(size_t count) {
+  if (count > handle_slots_len) {
+    if (handle_slots == NULL)
+      handle_slots = MemoryContextAlloc(TopMemoryContext, mul_size(sizeof(CurlHandle), count));
+    else
+      handle_slots = repalloc(handle_slots, mul_size(sizeof(CurlHandle), count));
+
+    MemSet(&handle_slots[handle_slots_len], 0, sizeof(CurlHandle) * (count - handle_slots_len));
+    handle_slots_len = count;
+  }
+  return handle_slots;
+}
+
+static bool is_extension_installed(void) {
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  bool installed = OidIsValid(get_extension_oid("pg_net", true));
+  CommitTransactionCommand();
+  return installed;
+}
+
+// check in a probe worker whether pg_net is installed on a database and if so launch its worker,
+// see pg_net_probe. Returns whether the database is known to be without pg_net.
+static bool probe_database(const char *database_name) {
+  BackgroundWorker worker = {
+    .bgw_flags         = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION,
+    .bgw_start_time    = BgWorkerStart_RecoveryFinished,
+    .bgw_library_name  = "pg_net",
+    .bgw_function_name = "pg_net_probe",
+    .bgw_name          = "pg_net " EXTVERSION " probe",
+    .bgw_restart_time  = BGW_NEVER_RESTART,
+    .bgw_notify_pid    = MyProcPid,
+  };
+  strlcpy(worker.bgw_extra, database_name, BGW_EXTRALEN);
+
+  BackgroundWorkerHandle *handle;
+
+  pg_atomic_write_u32(&net_shmem->probe_found_no_ext, 0);
+
+  if (!RegisterDynamicBackgroundWorker(&worker, &handle)) return false;
+
+  if (WaitForBackgroundWorkerShutdown(handle) != BGWH_STOPPED) return false;
+
+  return pg_atomic_read_u32(&net_shmem->probe_found_no_ext) == 1;
+}
+
+// launch a worker for every other database with pg_net installed that isn't served yet. This also
+// relaunches the dynamic workers that died, so it runs again every launch_interval_ms.
+static void launch_database_workers(void) {
+  last_launch_time = GetCurrentTimestamp();
+
+  MemoryContext launch_context =
+      AllocSetContextCreate(TopMemoryContext, "pg_net launch", ALLOCSET_SMALL_SIZES);
+  MemoryContext old_context = CurrentMemoryContext;
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  SPI_connect();
+
+  int ret_code = SPI_execute_with_args("\
+      select oid, datname::text from pg_database\
+      where datallowconn and not datistemplate and oid <> $1",
+                                       1, (Oid[]){OIDOID},
+                                       (Datum[]){ObjectIdGetDatum(MyDatabaseId)}, NULL, true, 0);
+
+  if (ret_code != SPI_OK_SELECT)
+    ereport(ERROR, errmsg("Error getting databases: %s", SPI_result_code_string(ret_code)));
+
+  // copied out of the transaction, the probes are waited for outside of it
+  uint64 databases_len  = SPI_processed;
+  Oid   *database_oids  = MemoryContextAlloc(launch_context, sizeof(Oid) * (databases_len + 1));
+  char **database_names = MemoryContextAlloc(launch_context, sizeof(char *) * (databases_len + 1));
+
+  for (uint64 i = 0; i < databases_len; i++) {
+    bool isnull;
+    database_oids[i] = DatumGetObjectId(
+        SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull));
+    database_names[i] = MemoryContextStrdup(
+        launch_context, SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2));
+  }
+
+  SPI_finish();
+  PopActiveSnapshot();
+  CommitTransactionCommand();
+  MemoryContextSwitchTo(old_context);
+
+  for (uint64 i = 0; i < databases_len; i++) {
+    if (list_member_oid(databases_without_ext, database_oids[i])) continue;
+
+    // a database served by a worker that's gone has pg_net, its worker is launched again directly
+    if (get_database_worker(database_oids[i], database_names[i], false) != NULL) {
+      get_database_worker(database_oids[i], database_names[i], true);
+      continue;
+    }
+
+    // a database that gets pg_net later has its worker launched by its first request instead
+    if (probe_database(database_names[i])) {
+      MemoryContext list_context = MemoryContextSwitchTo(TopMemoryContext);
+      databases_without_ext      = lappend_oid(databases_without_ext, database_oids[i]);
+      MemoryContextSwitchTo(list_context);
+    }
+  }
+
+  MemoryContextDelete(launch_context);
+}
+
+static bool is_launch_due(void) {
+  return worker_slot == primary_worker_slot && guc_max_databases > 1 &&
+         TimestampDifferenceExceeds(last_launch_time, GetCurrentTimestamp(), launch_interval_ms);
 }
 
 // wait according to the wait type while ensuring interrupts are processed while waiting
@@ -191,6 +769,16 @@ static void wait_while_processing_interrupts(WorkerWait ww, bool *should_restart
               PG_WAIT_EXTENSION);
     ResetLatch(worker_state->shared_latch);
     break;
+  case WORKER_WAIT_WARM_INTERVAL:
+    WaitLatch(worker_state->shared_latch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+              warm_interval_ms, PG_WAIT_EXTENSION);
+    ResetLatch(worker_state->shared_latch);
+    break;
+  case WORKER_WAIT_LAUNCH_INTERVAL:
+    WaitLatch(worker_state->shared_latch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+              launch_interval_ms, PG_WAIT_EXTENSION);
+    ResetLatch(worker_state->shared_latch);
+    break;
   }
 
   CHECK_FOR_INTERRUPTS();
@@ -198,6 +786,11 @@ static void wait_while_processing_interrupts(WorkerWait ww, bool *should_restart
   if (got_sighup) {
     got_sighup = false;
     ProcessConfigFile(PGC_SIGHUP);
+    set_transport_config(guc_proxy, guc_unix_sockets);
+    set_circuit_breaker_config(guc_circuit_breaker_failures, guc_circuit_breaker_cooldown);
+    set_body_chunk_size(guc_body_chunk_size);
+    set_aggregate_limits(guc_aggregate_max_requests, guc_aggregate_max_size);
+    set_adaptive_concurrency(guc_adaptive_concurrency, guc_batch_size);
   }
 
   if (pg_atomic_exchange_u32(&worker_state->got_restart, 0)) {
@@ -246,8 +839,414 @@ static void unlock_extension(Oid ext_table_oids[static total_extension_tables])
   UnlockRelationOid(ext_table_oids[1], AccessShareLock);
 }
 
-void pg_net_worker(__attribute__((unused)) Datum main_arg) {
+// Serves the row from the response cache, the circuit breaker, an identical request of the batch or
+// one it's aggregated into, or else adds its transfer to the multi handle and returns true. This
+// runs in a subtransaction, an error for the row (an unsupported method, a failed
+// curl_easy_setopt) is stored as its response and the batch goes on, instead of aborting it and
+// retrying the same rows after every restart.
+static bool add_request(RequestQueueRow row, CurlHandle *handle, HTAB *coalesced,
+                        HTAB *aggregated, bool *deferred) {
+  MemoryContext context        = CurrentMemoryContext;
+  ResourceOwner owner          = CurrentResourceOwner;
+  volatile bool added          = false;
+  volatile bool limit_deferred = false;
+
+  BeginInternalSubTransaction(NULL);
+  MemoryContextSwitchTo(context);
+
+  PG_TRY();
+  {
+    // the error handling below needs the row as it came from the queue
+    RequestQueueRow request = row;
+    resolve_request_template(&request);
+
+    if (!(guc_cache_size > 0 && serve_cached_response(request, handle)) &&
+        !reject_by_circuit_breaker(request, handle) &&
+        !(coalesced && coalesce_request(coalesced, request, handle)) &&
+        !(aggregated && aggregate_request(aggregated, request, handle))) {
+      if (defer_by_concurrency_limit(request, handle)) {
+        // the row stays queued, the requests that joined it go with it
+        if (coalesced) forget_coalesce_leader(coalesced, handle);
+        if (aggregated) forget_coalesce_leader(aggregated, handle);
+        reset_curl_handle(handle);
+        limit_deferred = true;
+      } else {
+        init_curl_handle(handle, request);
+
+        // the transfer threads get the whole batch once it's complete, see submit_transfers
+        if (transfer_pool == NULL)
+          EREPORT_MULTI(curl_multi_add_handle(worker_state->curl_mhandle, handle->ez_handle));
+        added = true;
+      }
+    }
+
+    ReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(context);
+    CurrentResourceOwner = owner;
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(context);
+    ErrorData *error = CopyErrorData();
+    FlushErrorState();
+
+    RollbackAndReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(context);
+    CurrentResourceOwner = owner;
+
+    if (coalesced) forget_coalesce_leader(coalesced, handle);
+    if (aggregated) forget_coalesce_leader(aggregated, handle);
+    reset_curl_handle(handle);
+
+    ereport(WARNING, errmsg("pg_net request " INT64_FORMAT " failed: %s", row.id, error->message));
+
+    insert_error_response(row, error->message);
+    FreeErrorData(error);
+
+    added = false;
+  }
+  PG_END_TRY();
+
+  *deferred = limit_deferred;
+  return added;
+}
+
+// Locks the extension tables again for the next transaction of a batch. Unlike
+// is_extension_locked this waits, for example behind a truncate of the queue, as the transfers of
+// the batch are already running. Returns false when the extension was dropped.
+static bool relock_extension(Oid ext_table_oids[static total_extension_tables]) {
+  LockRelationOid(ext_table_oids[0], AccessShareLock);
+  LockRelationOid(ext_table_oids[1], AccessShareLock);
+
+  Oid net_oid = get_namespace_oid("net", true);
+
+  return OidIsValid(net_oid) &&
+         get_relname_relid("http_request_queue", net_oid) == ext_table_oids[0] &&
+         get_relname_relid("_http_response", net_oid) == ext_table_oids[1];
+}
+
+// Commits the responses inserted so far and starts a new transaction for the rest of the batch, so
+// an error or a crash later on only sends again the requests that didn't get their response.
+// Returns false when the extension was dropped in between.
+static bool commit_batch_progress(Oid ext_table_oids[static total_extension_tables]) {
+  extract_json_responses();
+  SPI_finish();
+  unlock_extension(ext_table_oids);
+  PopActiveSnapshot();
+
+  instr_time start;
+  INSTR_TIME_SET_CURRENT(start);
+  CommitTransactionCommand();
+  record_phase(PHASE_COMMIT, elapsed_us(start));
+
+  release_queue_depth(worker_state, pop_completed_requests());
+
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  PushActiveSnapshot(GetTransactionSnapshot());
+
+  bool locked = relock_extension(ext_table_oids);
+
+  SPI_connect();
+
+  return locked;
+}
+
+// The transfers of the requests cancelled with net.cancel are removed from the multi handle, so
+// they stop taking a slot and the batch doesn't wait for them
+static void remove_cancelled_transfers(CurlHandle *handles, size_t nhandles,
+                                       int *running_handles) {
+  bool *cancelled = palloc(sizeof(bool) * nhandles);
+  int   removed   = find_cancelled_transfers(handles, nhandles, cancelled);
+
+  for (size_t i = 0; i < nhandles; i++)
+    if (cancelled[i])
+      EREPORT_MULTI(curl_multi_remove_handle(worker_state->curl_mhandle, handles[i].ez_handle));
+
+  pfree(cancelled);
+
+  if (removed > 0) {
+    elog(DEBUG1, "Stopped %d cancelled transfers", removed);
+
+    // the running handles are only counted again by an action
+    EREPORT_MULTI(curl_multi_socket_action(worker_state->curl_mhandle, CURL_SOCKET_TIMEOUT, 0,
+                                           running_handles));
+  }
+}
+
+// Runs the curl event loop until all the transfers added to the multi handle are done. The
+// responses of a batch are committed as they come when ext_table_oids is given, returns false when
+// the extension was dropped meanwhile and the rest of the batch was abandoned.
+static bool run_transfers(Oid *ext_table_oids, CurlHandle *handles, size_t nhandles) {
+  int        running_handles = 0;
+  uint64     recorded_us     = 0; // time recorded in the insert and commit phases
+  instr_time start;
+  INSTR_TIME_SET_CURRENT(start);
+
+  do {
+    int nfds = wait_event(worker_state->epfd, events, max_events, curl_handle_event_timeout_ms);
+
+    if (nfds < 0) {
+      int save_errno = errno;
+      if (save_errno == EINTR) { // can happen when the wait is interrupted, for example when
+                                 // running under GDB. Just continue in this case.
+        elog(DEBUG1, "wait_event() got %s, continuing", strerror(save_errno));
+        continue;
+      } else {
+        ereport(ERROR, errmsg("wait_event() failed: %s", strerror(save_errno)));
+        break;
+      }
+    }
+
+    for (int i = 0; i < nfds; i++) {
+      if (is_timer(events[i])) {
+        EREPORT_MULTI(curl_multi_socket_action(worker_state->curl_mhandle, CURL_SOCKET_TIMEOUT, 0,
+                                               &running_handles));
+      } else {
+        int curl_event = get_curl_event(events[i]);
+        int sockfd     = get_socket_fd(events[i]);
+
+        EREPORT_MULTI(curl_multi_socket_action(worker_state->curl_mhandle, sockfd, curl_event,
+                                               &running_handles));
+      }
+    }
+
+    resume_paused_transfers();
+
+    // checked once nothing is paused, so a removed transfer is never left in the paused ones
+    if (handles && pg_atomic_exchange_u32(&worker_state->got_cancel, 0))
+      remove_cancelled_transfers(handles, nhandles, &running_handles);
+
+    // insert finished responses
+    CURLMsg *msg       = NULL;
+    int      msgs_left = 0;
+    int      inserted  = 0;
+    while ((msg = curl_multi_info_read(worker_state->curl_mhandle, &msgs_left))) {
+      if (msg->msg == CURLMSG_DONE) {
+        CurlHandle *handle = NULL;
+        EREPORT_CURL_GETINFO(msg->easy_handle, CURLINFO_PRIVATE, &handle);
+        if (handle) {
+          instr_time insert_start;
+          INSTR_TIME_SET_CURRENT(insert_start);
+
+          insert_response(handle, msg->data.result);
+
+          uint64 us = elapsed_us(insert_start);
+          record_phase(PHASE_INSERT, us);
+          recorded_us += us;
+          inserted++;
+        } else { // a connection warming handle, see warm_connections
+          elog(DEBUG1, "pg_net warmed a connection: %s", curl_easy_strerror(msg->data.result));
+          EREPORT_MULTI(curl_multi_remove_handle(worker_state->curl_mhandle, msg->easy_handle));
+          curl_easy_cleanup(msg->easy_handle);
+        }
+      } else {
+        ereport(ERROR, errmsg("curl_multi_info_read(), CURLMsg=%d\n", msg->msg));
+      }
+    }
+
+    // the last responses are committed with the rest of the batch
+    if (ext_table_oids && inserted > 0 && running_handles > 0) {
+      instr_time commit_start;
+      INSTR_TIME_SET_CURRENT(commit_start);
+
+      bool locked = commit_batch_progress(ext_table_oids);
+
+      recorded_us += elapsed_us(commit_start);
+
+      if (!locked) {
+        elog(DEBUG1, "pg_net extension dropped, abandoning %d transfers", running_handles);
+        return false;
+      }
+    }
+
+    elog(DEBUG1, "Pending curl running_handles: %d", running_handles);
+    // run while there are curl handles, some won't finish in a single iteration since they could
+    // be slow and waiting for a timeout
+  } while (running_handles > 0);
+
+  record_phase(PHASE_TRANSFER, elapsed_us(start) - recorded_us);
+
+  return true;
+}
+
+// Hands the transfers of the batch to the threads. This waits for the aggregates to be finished,
+// as their bodies can't change once a thread sends them.
+static void submit_transfers(CurlHandle *handles, size_t nhandles) {
+  size_t chunk_size = (size_t)guc_body_chunk_size * 1024;
+
+  for (size_t i = 0; i < nhandles; i++) {
+    handles[i].transfer = transfer_pool_submit(transfer_pool, handles[i].ez_handle, &handles[i],
+                                               handles[i].url, chunk_size);
+
+    if (handles[i].transfer == NULL) ereport(ERROR, errmsg("out of memory"));
+  }
+}
+
+// Waits up to a second for the threads to hand back transfers and takes them
+static void collect_transfers(void) {
+  WaitLatchOrSocket(NULL, WL_SOCKET_READABLE | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                    transfer_pool_notify_fd(transfer_pool), curl_handle_event_timeout_ms,
+                    PG_WAIT_EXTENSION);
+
+  CURLMcode failure = transfer_pool_collect(transfer_pool);
+  if (failure != CURLM_OK)
+    ereport(ERROR, errmsg("pg_net transfer thread failed: %s", curl_multi_strerror(failure)));
+}
+
+// Stops the transfers of an abandoned batch and waits for the threads to give their easy handles
+// back
+static void abandon_transfers(CurlHandle *handles, size_t nhandles) {
+  for (size_t i = 0; i < nhandles; i++)
+    if (handles[i].transfer) transfer_cancel(handles[i].transfer);
+
+  while (transfer_pool_in_flight(transfer_pool) > 0) {
+    collect_transfers();
+
+    Transfer *transfer;
+    while ((transfer = transfer_pool_next(transfer_pool))) {
+      CurlHandle *handle = (CurlHandle *)transfer_owner(transfer);
+
+      // a resumed transfer is removed, as it's cancelled
+      if (transfer_event(transfer) == TRANSFER_CHUNK) {
+        transfer_resume(transfer);
+        continue;
+      }
+
+      // a connection warming handle belongs to no request, see warm_connections
+      if (handle)
+        handle->transfer = NULL;
+      else
+        curl_easy_cleanup(transfer_ez_handle(transfer));
+
+      transfer_free(transfer);
+    }
+  }
+}
+
+// Like run_transfers, for the requests sent by the transfer threads. The worker only waits for them
+// to hand back the transfers that are done, and writes the body chunks and responses they got.
+static bool run_threaded_transfers(Oid *ext_table_oids, CurlHandle *handles, size_t nhandles) {
+  uint64     recorded_us = 0; // time recorded in the insert and commit phases
+  instr_time start;
+  INSTR_TIME_SET_CURRENT(start);
+
+  while (transfer_pool_in_flight(transfer_pool) > 0) {
+    collect_transfers();
+
+    Transfer *transfer;
+    int       inserted = 0;
+    while ((transfer = transfer_pool_next(transfer_pool))) {
+      CurlHandle *handle = (CurlHandle *)transfer_owner(transfer);
+      size_t      body_len;
+      const char *body = transfer_body(transfer, &body_len);
+
+      if (handle == NULL) { // a connection warming handle, see warm_connections
+        elog(DEBUG1, "pg_net warmed a connection: %s",
+             curl_easy_strerror(transfer_result(transfer)));
+        curl_easy_cleanup(transfer_ez_handle(transfer));
+        transfer_free(transfer);
+        continue;
+      }
+
+      switch (transfer_event(transfer)) {
+      case TRANSFER_CHUNK:
+        if (body_len > 0) appendBinaryStringInfo(handle->body, body, (int)body_len);
+        write_body_chunk(handle);
+        transfer_resume(transfer);
+        break;
+      case TRANSFER_DONE: {
+        if (body_len > 0) appendBinaryStringInfo(handle->body, body, (int)body_len);
+        CURLcode result = transfer_result(transfer);
+        handle->transfer = NULL;
+        transfer_free(transfer);
+
+        instr_time insert_start;
+        INSTR_TIME_SET_CURRENT(insert_start);
+
+        insert_response(handle, result);
+
+        uint64 us = elapsed_us(insert_start);
+        record_phase(PHASE_INSERT, us);
+        recorded_us += us;
+        inserted++;
+        break;
+      }
+      case TRANSFER_REMOVED:
+        handle->transfer = NULL;
+        transfer_free(transfer);
+        break;
+      }
+    }
+
+    if (handles && pg_atomic_exchange_u32(&worker_state->got_cancel, 0)) {
+      bool *cancelled = palloc(sizeof(bool) * nhandles);
+      int   stopping  = find_cancelled_transfers(handles, nhandles, cancelled);
+
+      for (size_t i = 0; i < nhandles; i++)
+        if (cancelled[i] && handles[i].transfer) transfer_cancel(handles[i].transfer);
+
+      pfree(cancelled);
+
+      if (stopping > 0) elog(DEBUG1, "Stopping %d cancelled transfers", stopping);
+    }
+
+    // the last responses are committed with the rest of the batch
+    if (ext_table_oids && inserted > 0 && transfer_pool_in_flight(transfer_pool) > 0) {
+      instr_time commit_start;
+      INSTR_TIME_SET_CURRENT(commit_start);
+
+      bool locked = commit_batch_progress(ext_table_oids);
+
+      recorded_us += elapsed_us(commit_start);
+
+      if (!locked) {
+        elog(DEBUG1, "pg_net extension dropped, abandoning %d transfers",
+             transfer_pool_in_flight(transfer_pool));
+        abandon_transfers(handles, nhandles);
+        return false;
+      }
+    }
+
+    elog(DEBUG1, "Pending transfers: %d", transfer_pool_in_flight(transfer_pool));
+  }
+
+  record_phase(PHASE_TRANSFER, elapsed_us(start) - recorded_us);
+
+  return true;
+}
+
+// Connect to the pg_net.warm_origins in advance, so the requests sent to them don't pay for DNS,
+// TCP and TLS setup. The connections stay on the multi handle's connection cache.
+static void warm_connections(void) {
+  last_warm_time = GetCurrentTimestamp();
+
+  if (add_warm_handles(worker_state->curl_mhandle, transfer_pool, guc_warm_origins) > 0) {
+    if (transfer_pool)
+      run_threaded_transfers(NULL, NULL, 0);
+    else
+      run_transfers(NULL, NULL, 0);
+  }
+}
+
+static bool is_warm_due(void) {
+  return guc_warm_origins[0] != '\0' &&
+         TimestampDifferenceExceeds(last_warm_time, GetCurrentTimestamp(), warm_interval_ms);
+}
+
+void pg_net_worker(Datum main_arg) {
+  worker_slot  = DatumGetInt32(main_arg);
+  worker_state = &net_shmem->workers[worker_slot];
+
+  // the state left by a previous worker on this slot belongs to another process
+  worker_state->epfd         = -1;
+  worker_state->curl_mhandle = NULL;
+
+  char *database_name =
+      worker_slot == primary_worker_slot ? guc_database_name : MyBgworkerEntry->bgw_extra;
+
   worker_state->shared_latch = &MyProc->procLatch;
+  worker_state->pid          = MyProcPid;
   on_proc_exit(net_on_exit, 0);
 
   BackgroundWorkerUnblockSignals();
@@ -255,13 +1254,20 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
   pqsignal(SIGHUP, handle_sighup);
   pqsignal(SIGUSR1, handle_sigusr1);
 
-  BackgroundWorkerInitializeConnection(guc_database_name, guc_username, 0);
+  BackgroundWorkerInitializeConnection(database_name, guc_username, 0);
   pgstat_report_appname("pg_net " EXTVERSION); // set appname for pg_stat_activity
 
+  if (worker_slot == primary_worker_slot) {
+    worker_state->database_oid = MyDatabaseId;
+  } else if (!is_extension_installed()) {
+    elog(DEBUG1, "pg_net is not installed on database %s, exiting", database_name);
+    proc_exit(0);
+  }
+
   elog(INFO,
        "pg_net worker started with a config of: pg_net.ttl=%s, pg_net.batch_size=%d, "
        "pg_net.username=%s, pg_net.database_name=%s",
-       guc_ttl, guc_batch_size, guc_username, guc_database_name);
+       guc_ttl, guc_batch_size, guc_username, database_name);
 
   int curl_ret = curl_global_init(CURL_GLOBAL_ALL);
   if (curl_ret != CURLE_OK)
@@ -278,8 +1284,27 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
 
   set_curl_mhandle(worker_state);
 
+  set_transport_config(guc_proxy, guc_unix_sockets);
+  set_circuit_breaker_config(guc_circuit_breaker_failures, guc_circuit_breaker_cooldown);
+  set_body_chunk_size(guc_body_chunk_size);
+  set_aggregate_limits(guc_aggregate_max_requests, guc_aggregate_max_size);
+  set_adaptive_concurrency(guc_adaptive_concurrency, guc_batch_size);
+
+  if (guc_transfer_threads > 0) {
+    transfer_pool = transfer_pool_start(guc_transfer_threads);
+    if (transfer_pool == NULL)
+      ereport(ERROR, errmsg("could not start the pg_net transfer threads: %m"));
+  }
+
+  batch_context = AllocSetContextCreate(TopMemoryContext, "pg_net batch", ALLOCSET_DEFAULT_SIZES);
+  events        = MemoryContextAlloc(TopMemoryContext, sizeof(event) * max_events);
+
   publish_state(WS_RUNNING);
 
+  if (worker_slot == primary_worker_slot && guc_max_databases > 1) launch_database_workers();
+
+  warm_connections();
+
   // Initial state: we go straight into the outer loop and wait for a wake.
   pgstat_report_activity(STATE_IDLE, NULL);
 
@@ -287,8 +1312,18 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
 
     uint32 expected = 1;
     if (!pg_atomic_compare_exchange_u32(&worker_state->should_wake, &expected, 0)) {
+      if (is_warm_due()) warm_connections();
+      if (is_launch_due()) launch_database_workers();
+
+      // the launch interval is the shorter one, warming is checked on every wake anyway
+      WorkerWait ww = WORKER_WAIT_NO_TIMEOUT;
+      if (worker_slot == primary_worker_slot && guc_max_databases > 1)
+        ww = WORKER_WAIT_LAUNCH_INTERVAL;
+      else if (guc_warm_origins[0] != '\0')
+        ww = WORKER_WAIT_WARM_INTERVAL;
+
       elog(DEBUG1, "pg_net worker waiting for wake");
-      wait_while_processing_interrupts(WORKER_WAIT_NO_TIMEOUT, &worker_should_restart);
+      wait_while_processing_interrupts(ww, &worker_should_restart);
       continue;
     }
 
@@ -298,6 +1333,10 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
     uint64 expired_responses = 0;
 
     do {
+      // read before the snapshot is taken, see wake_at_commit
+      uint32 generation = pg_atomic_read_u32(&worker_state->templates_generation);
+      pg_read_barrier();
+
       SetCurrentStatementStartTimestamp();
       StartTransactionCommand();
       PushActiveSnapshot(GetTransactionSnapshot());
@@ -313,95 +1352,111 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
 
       SPI_connect();
 
+      instr_time phase_start;
+
+      if (generation != templates_generation) {
+        reset_request_templates();
+        templates_generation = generation;
+      }
+
+      INSTR_TIME_SET_CURRENT(phase_start);
       expired_responses = delete_expired_responses(guc_ttl, guc_batch_size);
+      record_phase(PHASE_EXPIRE, elapsed_us(phase_start));
 
       elog(DEBUG1, "Deleted " UINT64_FORMAT " expired rows", expired_responses);
 
-      requests_consumed = consume_request_queue(guc_batch_size);
+      bool queue_drained;
+
+      INSTR_TIME_SET_CURRENT(phase_start);
+      requests_consumed = consume_request_queue(concurrency_batch_size(guc_batch_size),
+                                                guc_tenant_max_in_flight, &queue_drained);
+      record_phase(PHASE_DEQUEUE, elapsed_us(phase_start));
 
       elog(DEBUG1, "Consumed " UINT64_FORMAT " request rows", requests_consumed);
 
+      // the batch has all the queued requests, the approximate depth starts over from it. This is
+      // also how it goes back to 0 once the worker is idle, see recount_queue_depth
+      if (queue_drained) pg_atomic_write_u64(&worker_state->queue_depth, requests_consumed);
+
+      bool batch_completed = true;
+
       if (requests_consumed > 0) {
-        CurlHandle *handles = palloc(mul_size(sizeof(CurlHandle), requests_consumed));
+        MemoryContext old_context = MemoryContextSwitchTo(batch_context);
+        CurlHandle   *handles     = get_handle_slots(requests_consumed);
+
+        HTAB *coalesced =
+            guc_coalesce_gets ? create_coalesce_table(batch_context, requests_consumed) : NULL;
+        HTAB *aggregated = guc_aggregate_max_requests > 1
+                               ? create_coalesce_table(batch_context, requests_consumed)
+                               : NULL;
+        size_t nhandles = 0;
+        size_t ndeferred = 0;
+
+        INSTR_TIME_SET_CURRENT(phase_start);
+
+        // the responses inserted while adding the requests replace SPI_tuptable
+        SPITupleTable *queue_rows = SPI_tuptable;
 
         // initialize curl handles
         for (size_t j = 0; j < requests_consumed; j++) {
-          init_curl_handle(&handles[j],
-                           get_request_queue_row(SPI_tuptable->vals[j], SPI_tuptable->tupdesc));
+          RequestQueueRow row = get_request_queue_row(queue_rows->vals[j], queue_rows->tupdesc);
 
-          EREPORT_MULTI(curl_multi_add_handle(worker_state->curl_mhandle, handles[j].ez_handle));
+          bool deferred;
+          if (add_request(row, &handles[nhandles], coalesced, aggregated, &deferred)) nhandles++;
+          if (deferred) ndeferred++;
         }
 
-        // start curl event loop
-        int   running_handles = 0;
-        int   maxevents       = requests_consumed + 1; // 1 extra for the timer
-        event events[maxevents];
-
-        do {
-          int nfds =
-              wait_event(worker_state->epfd, events, maxevents, curl_handle_event_timeout_ms);
-
-          if (nfds < 0) {
-            int save_errno = errno;
-            if (save_errno == EINTR) { // can happen when the wait is interrupted, for example when
-                                       // running under GDB. Just continue in this case.
-              elog(DEBUG1, "wait_event() got %s, continuing", strerror(save_errno));
-              continue;
-            } else {
-              ereport(ERROR, errmsg("wait_event() failed: %s", strerror(save_errno)));
-              break;
-            }
-          }
-
-          for (int i = 0; i < nfds; i++) {
-            if (is_timer(events[i])) {
-              EREPORT_MULTI(curl_multi_socket_action(worker_state->curl_mhandle,
-                                                     CURL_SOCKET_TIMEOUT, 0, &running_handles));
-            } else {
-              int curl_event = get_curl_event(events[i]);
-              int sockfd     = get_socket_fd(events[i]);
-
-              EREPORT_MULTI(curl_multi_socket_action(worker_state->curl_mhandle, sockfd, curl_event,
-                                                     &running_handles));
-            }
-          }
-
-          // insert finished responses
-          CURLMsg *msg       = NULL;
-          int      msgs_left = 0;
-          while ((msg = curl_multi_info_read(worker_state->curl_mhandle, &msgs_left))) {
-            if (msg->msg == CURLMSG_DONE) {
-              CurlHandle *handle = NULL;
-              EREPORT_CURL_GETINFO(msg->easy_handle, CURLINFO_PRIVATE, &handle);
-              insert_response(handle, msg->data.result);
-            } else {
-              ereport(ERROR, errmsg("curl_multi_info_read(), CURLMsg=%d\n", msg->msg));
-            }
-          }
-
-          elog(DEBUG1, "Pending curl running_handles: %d", running_handles);
-          // run while there are curl handles, some won't finish in a single iteration since they
-          // could be slow and waiting for a timeout
-        } while (running_handles > 0);
+        if (aggregated) finish_aggregates(aggregated);
+
+        if (transfer_pool) submit_transfers(handles, nhandles);
+
+        record_phase(PHASE_INIT, elapsed_us(phase_start));
+
+        if (nhandles + ndeferred < requests_consumed)
+          elog(DEBUG1, "Served " UINT64_FORMAT " requests without their own transfer",
+               requests_consumed - (uint64)(nhandles + ndeferred));
+
+        // the deferred requests are still queued, see pg_net.adaptive_concurrency
+        if (ndeferred > 0) {
+          elog(DEBUG1, "Deferred %zu requests to hosts at their concurrency limit", ndeferred);
+          queue_drained = false;
+        }
+
+        // the transaction of old_context can be committed by run_transfers, which leaves the
+        // memory context of the new transaction's SPI connection as the current one
+        MemoryContextSwitchTo(old_context);
+
+        batch_completed = transfer_pool ? run_threaded_transfers(ext_table_oids, handles, nhandles)
+                                        : run_transfers(ext_table_oids, handles, nhandles);
 
         // cleanup
-        for (uint64 i = 0; i < requests_consumed; i++) {
+        for (size_t i = 0; i < nhandles; i++) {
           EREPORT_MULTI(curl_multi_remove_handle(worker_state->curl_mhandle, handles[i].ez_handle));
 
-          curl_easy_cleanup(handles[i].ez_handle);
-
-          pfree_handle(&handles[i]);
+          reset_curl_handle(&handles[i]);
         }
 
-        pfree(handles);
+        adapt_concurrency_limits();
+
+        MemoryContextReset(batch_context);
       }
 
+      if (batch_completed && queue_drained && truncate_request_queue(ext_table_oids[0]))
+        elog(DEBUG1, "Truncated the drained request queue");
+
+      extract_json_responses();
+
       SPI_finish();
 
       unlock_extension(ext_table_oids);
 
       PopActiveSnapshot();
+
+      INSTR_TIME_SET_CURRENT(phase_start);
       CommitTransactionCommand();
+      record_phase(PHASE_COMMIT, elapsed_us(phase_start));
+
+      release_queue_depth(worker_state, pop_completed_requests());
 
       // Background workers that modify tables must flush their pending
       // pgstat counters themselves. Regular user backends do this
@@ -412,6 +1467,10 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
       // stats.
       pgstat_report_stat(false);
 
+      // a primary that keeps getting wakes never idles, the dead workers are relaunched from here
+      // too
+      if (is_launch_due()) launch_database_workers();
+
       // slow down queue processing to avoid using too much CPU
       wait_while_processing_interrupts(WORKER_WAIT_ONE_SECOND, &worker_should_restart);
 
@@ -424,19 +1483,51 @@ void pg_net_worker(__attribute__((unused)) Datum main_arg) {
 
   publish_state(WS_EXITED);
 
+  if (worker_slot != primary_worker_slot) {
+    // The postmaster doesn't restart dynamic workers. Launch the replacement ourselves, only after
+    // our state is cleaned up so it doesn't get cleaned up from under the new worker.
+    // claimed again first, so the slot isn't found gone once this process stops being its worker
+    SpinLockAcquire(&net_shmem->mutex);
+    worker_state->claimed_at = GetCurrentTimestamp();
+    pg_atomic_write_u32(&worker_state->status, WS_NOT_YET);
+    SpinLockRelease(&net_shmem->mutex);
+
+    worker_relaunched = true;
+    net_on_exit(0, (Datum)0);
+    if (!register_database_worker(worker_slot, database_name)) release_worker_slot(worker_state);
+    proc_exit(0);
+  }
+
   // causing a failure on exit will make the postmaster process restart the bg worker
   proc_exit(EXIT_FAILURE);
 }
 
+// launched by launch_database_workers for a database that might have pg_net installed. It doesn't
+// take a slot unless pg_net is there, so databases without it don't use up pg_net.max_databases.
+void pg_net_probe(__attribute__((unused)) Datum main_arg) {
+  BackgroundWorkerUnblockSignals();
+
+  BackgroundWorkerInitializeConnection(MyBgworkerEntry->bgw_extra, guc_username, 0);
+
+  if (is_extension_installed())
+    get_database_worker(MyDatabaseId, MyBgworkerEntry->bgw_extra, true);
+  else
+    pg_atomic_write_u32(&net_shmem->probe_found_no_ext, 1);
+
+  proc_exit(0);
+}
+
 static Size net_memsize(void) {
-  return MAXALIGN(sizeof(WorkerState));
+  return MAXALIGN(
+      add_size(offsetof(NetShmem, workers), mul_size(sizeof(WorkerState), guc_max_databases)));
 }
 
 #if PG15_GTE
 static void net_shmem_request(void) {
   if (prev_shmem_request_hook) prev_shmem_request_hook();
 
-  RequestAddinShmemSpace(net_memsize());
+  RequestAddinShmemSpace(add_size(net_memsize(), cache_shmem_size(guc_cache_size)));
+  cache_shmem_request(guc_cache_size);
 }
 #endif
 
@@ -447,19 +1538,42 @@ static void net_shmem_startup(void) {
 
   LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
-  worker_state = ShmemInitStruct("pg_net worker state", sizeof(WorkerState), &found);
+  net_shmem = ShmemInitStruct("pg_net worker state", net_memsize(), &found);
 
   if (!found) {
-    pg_atomic_init_u32(&worker_state->got_restart, 0);
-    pg_atomic_init_u32(&worker_state->status, WS_NOT_YET);
-    pg_atomic_init_u32(&worker_state->should_wake, 1);
-    worker_state->shared_latch = NULL;
+    SpinLockInit(&net_shmem->mutex);
+    net_shmem->slots_full_warned = false;
+    pg_atomic_init_u32(&net_shmem->probe_found_no_ext, 0);
+
+    for (int i = 0; i < guc_max_databases; i++) {
+      WorkerState *ws = &net_shmem->workers[i];
+
+      ws->database_oid = InvalidOid;
+      ws->pid          = 0;
+      ws->claimed_at   = 0;
+      pg_atomic_init_u32(&ws->got_restart, 0);
+      pg_atomic_init_u32(&ws->got_cancel, 0);
+      pg_atomic_init_u32(&ws->templates_generation, 0);
+      pg_atomic_init_u32(&ws->status, WS_NOT_YET);
+      pg_atomic_init_u32(&ws->should_wake, 1);
+      ws->shared_latch = NULL;
+
+      ConditionVariableInit(&ws->cv);
+      ws->epfd         = 0;
+      ws->curl_mhandle = NULL;
+
+      for (int p = 0; p < WORKER_PHASE_COUNT; p++) {
+        pg_atomic_init_u64(&ws->profile[p].calls, 0);
+        pg_atomic_init_u64(&ws->profile[p].total_us, 0);
+        pg_atomic_init_u64(&ws->profile[p].max_us, 0);
+      }
 
-    ConditionVariableInit(&worker_state->cv);
-    worker_state->epfd         = 0;
-    worker_state->curl_mhandle = NULL;
+      pg_atomic_init_u64(&ws->queue_depth, 0);
+    }
   }
 
+  cache_shmem_init(guc_cache_size);
+
   LWLockRelease(AddinShmemInitLock);
 }
 
@@ -483,16 +1597,6 @@ void _PG_init(void) {
     .bgw_restart_time  = net_worker_restart_time_sec,
   });
 
-#if PG15_GTE
-  prev_shmem_request_hook = shmem_request_hook;
-  shmem_request_hook      = net_shmem_request;
-#else
-  RequestAddinShmemSpace(net_memsize());
-#endif
-
-  prev_shmem_startup_hook = shmem_startup_hook;
-  shmem_startup_hook      = net_shmem_startup;
-
   DefineCustomStringVariable("pg_net.ttl", "time to live for request/response rows",
                              "should be a valid interval type", &guc_ttl, "6 hours", PGC_SIGHUP, 0,
                              NULL, NULL, NULL);
@@ -507,4 +1611,123 @@ void _PG_init(void) {
 
   DefineCustomStringVariable("pg_net.username", "Connection user for the worker", NULL,
                              &guc_username, NULL, PGC_SU_BACKEND, 0, NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.max_databases",
+                          "max number of databases served, each one with its own worker",
+                          "when greater than 1, a worker is launched for every database where "
+                          "pg_net is installed",
+                          &guc_max_databases, 1, 1, 1024, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+      "pg_net.warm_origins", "origins the worker keeps connections open to",
+      "comma separated list of origins, e.g. 'https://example.com, http://localhost:8080'",
+      &guc_warm_origins, "", PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomStringVariable("pg_net.proxy", "proxy used for all the requests",
+                             "a proxy url as understood by libcurl, e.g. 'http://localhost:3128'",
+                             &guc_proxy, "", PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+      "pg_net.unix_sockets", "hosts whose requests are sent over a unix domain socket",
+      "comma separated list of host=/path/to/socket, e.g. 'sidecar=/run/sidecar.sock'",
+      &guc_unix_sockets, "", PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("pg_net.coalesce_gets",
+                           "identical GET requests in the same batch share a single transfer", NULL,
+                           &guc_coalesce_gets, false, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.cache_size",
+                          "size of the cache of GET responses shared by the workers",
+                          "responses are cached according to their Cache-Control and ETag or "
+                          "Last-Modified headers, 0 disables the cache",
+                          &guc_cache_size, 0, 0, MAX_KILOBYTES, PGC_POSTMASTER, GUC_UNIT_KB, NULL,
+                          NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.circuit_breaker_failures",
+                          "consecutive connection failures or timeouts that open a host's circuit",
+                          "requests to a host with an open circuit fail fast until the cool-down "
+                          "is over, 0 disables the circuit breaker",
+                          &guc_circuit_breaker_failures, 0, 0, INT_MAX, PGC_SIGHUP, 0, NULL, NULL,
+                          NULL);
+
+  DefineCustomIntVariable("pg_net.circuit_breaker_cooldown",
+                          "time a host's circuit stays open before a request probes the host", NULL,
+                          &guc_circuit_breaker_cooldown, 30000, 1, INT_MAX, PGC_SIGHUP, GUC_UNIT_MS,
+                          NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.body_chunk_size",
+                          "size of the chunks response bodies are stored in while they arrive",
+                          "bodies bigger than this are stored in net._http_response_chunk instead "
+                          "of net._http_response.content, 0 disables chunked storage",
+                          &guc_body_chunk_size, 0, 0, 512 * 1024, PGC_SIGHUP, GUC_UNIT_KB, NULL,
+                          NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.aggregate_max_requests",
+                          "max number of requests with an aggregate_key sent in a single request",
+                          "1 disables aggregation", &guc_aggregate_max_requests, 100, 1, INT_MAX,
+                          PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.aggregate_max_size",
+                          "max size of the body of a request aggregating other requests", NULL,
+                          &guc_aggregate_max_size, 1024, 1, MAX_KILOBYTES, PGC_SIGHUP, GUC_UNIT_KB,
+                          NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.queue_max_depth",
+                          "number of queued requests at which pg_net.queue_full_policy applies",
+                          "0 lets the queue grow without limit", &guc_queue_max_depth, 0, 0,
+                          INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomEnumVariable("pg_net.queue_full_policy",
+                           "what happens to a request enqueued while the queue is full",
+                           "reject it, block until there's room or drop lower priority requests",
+                           &guc_queue_full_policy, QUEUE_FULL_REJECT, queue_full_policies,
+                           PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.queue_block_timeout",
+                          "max time a request waits for room in a full queue before it's rejected",
+                          NULL, &guc_queue_block_timeout, 5000, 0, INT_MAX, PGC_USERSET,
+                          GUC_UNIT_MS, NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.tenant_max_in_flight",
+                          "max number of requests of a tenant the worker sends at the same time",
+                          "0 only limits them to pg_net.batch_size", &guc_tenant_max_in_flight, 0,
+                          0, INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomStringVariable("pg_net.tenant", "tenant the requests made in the session belong to",
+                             "defaults to the role making the requests", &guc_tenant, "",
+                             PGC_USERSET, 0, NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("pg_net.adaptive_concurrency",
+                           "adapt the requests in flight to the latency and errors of responses",
+                           "pg_net.batch_size is the ceiling", &guc_adaptive_concurrency, false,
+                           PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomIntVariable("pg_net.transfer_threads",
+                          "number of threads sending the requests of the worker",
+                          "0 sends them from the worker process, a change takes effect when the "
+                          "worker restarts",
+                          &guc_transfer_threads, 0, 0, 64, PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("pg_net.tracing",
+                           "requests get a W3C traceparent header and their span is recorded",
+                           "spans are recorded in net._http_request_span", &guc_tracing, false,
+                           PGC_SUSET, 0, NULL, NULL, NULL);
+
+  DefineCustomStringVariable("pg_net.traceparent",
+                             "trace context inherited by the requests made in the session",
+                             "a W3C traceparent, e.g. "
+                             "'00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01'",
+                             &guc_traceparent, "", PGC_USERSET, 0, NULL, NULL, NULL);
+
+  // the shared memory size depends on pg_net.max_databases and pg_net.cache_size
+#if PG15_GTE
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook      = net_shmem_request;
+#else
+  RequestAddinShmemSpace(add_size(net_memsize(), cache_shmem_size(guc_cache_size)));
+  cache_shmem_request(guc_cache_size);
+#endif
+
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook      = net_shmem_startup;
 }
@@ -0,0 +1,182 @@
+import os
+import subprocess
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+import pytest
+from sqlalchemy import create_engine, text
+from sqlalchemy.orm import Session
+
+
+class CachingHandler(BaseHTTPRequestHandler):
+    """Answers with the caching headers of its path and records the requests it gets"""
+
+    def do_GET(self):
+        self.server.requests.append(self.path)
+
+        validators = {}
+        cache_control = "max-age=60"
+
+        if self.path.startswith("/etag"):
+            validators = {"ETag": '"v1"'}
+            cache_control = "no-cache"
+            unchanged = self.headers.get("If-None-Match") == '"v1"'
+        elif self.path.startswith("/last-modified"):
+            validators = {"Last-Modified": "Wed, 21 Oct 2015 07:28:00 GMT"}
+            cache_control = "no-cache"
+            unchanged = self.headers.get("If-Modified-Since") is not None
+        elif self.path.startswith("/short"):
+            cache_control = "max-age=1"
+            unchanged = False
+        else:
+            unchanged = False
+
+        if unchanged:
+            self.send_response(304)
+            for name, value in validators.items():
+                self.send_header(name, value)
+            self.end_headers()
+            return
+
+        # a big body for the eviction test
+        body = ("x" * 8000 if self.path.startswith("/big") else f"{self.path} response").encode()
+
+        self.send_response(200)
+        self.send_header("Cache-Control", cache_control)
+        for name, value in validators.items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def restart():
+    subprocess.run(["pg_ctl", "restart", "-D", os.getenv('PGDATA')])
+    # give it some time to finish restart
+    time.sleep(1)
+
+
+@pytest.fixture(scope="module")
+def server():
+    server = HTTPServer(("localhost", 0), CachingHandler)
+    server.requests = []
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    engine = create_engine("postgresql:///postgres")
+    tmp_sess = Session(engine.execution_options(isolation_level="AUTOCOMMIT"))
+    # 64 blocks of 1kB, so a response can take up to 16 of them
+    tmp_sess.execute(text("alter system set pg_net.cache_size to '64kB';"))
+    tmp_sess.execute(text("alter system set pg_net.max_databases to 2;"))
+    engine.dispose()
+
+    restart()
+
+    yield server
+
+    engine = create_engine("postgresql:///postgres")
+    tmp_sess = Session(engine.execution_options(isolation_level="AUTOCOMMIT"))
+    tmp_sess.execute(text("alter system reset pg_net.cache_size;"))
+    tmp_sess.execute(text("alter system reset pg_net.max_databases;"))
+    engine.dispose()
+
+    restart()
+    server.shutdown()
+
+
+def get(session, url):
+    (request_id,) = session.execute(text("select net.http_get(:url);"), {"url": url}).fetchone()
+    session.commit()
+
+    session.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    return session.execute(text(
+        """
+        select status_code, content from net._http_response where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+
+def test_cache_serves_fresh_responses(server, sess):
+    """Check that a fresh cached response is served without a transfer"""
+    url = f"http://localhost:{server.server_address[1]}/fresh"
+
+    assert get(sess, url) == (200, "/fresh response")
+    assert get(sess, url) == (200, "/fresh response")
+
+    assert server.requests.count("/fresh") == 1
+
+
+def test_cache_expires_responses(server, sess):
+    """Check that a response is fetched again once its max-age has passed"""
+    url = f"http://localhost:{server.server_address[1]}/short"
+
+    get(sess, url)
+    time.sleep(1.5)
+    assert get(sess, url) == (200, "/short response")
+
+    assert server.requests.count("/short") == 2
+
+
+def test_cache_revalidates_stale_responses(server, sess):
+    """Check that a stale response with an ETag is revalidated and reused on a 304"""
+    url = f"http://localhost:{server.server_address[1]}/etag"
+
+    assert get(sess, url) == (200, "/etag response")
+    # the server answers the conditional request with a 304, the cached response is inserted
+    assert get(sess, url) == (200, "/etag response")
+
+    assert server.requests.count("/etag") == 2
+
+
+def test_cache_revalidates_with_last_modified(server, sess):
+    """Check that a stale response with a Last-Modified is revalidated and reused on a 304"""
+    url = f"http://localhost:{server.server_address[1]}/last-modified"
+
+    assert get(sess, url) == (200, "/last-modified response")
+    assert get(sess, url) == (200, "/last-modified response")
+
+    assert server.requests.count("/last-modified") == 2
+
+
+def test_cache_evicts_least_recently_used(server, sess):
+    """Check that the least recently used responses are evicted when the cache is full"""
+    port = server.server_address[1]
+
+    for i in range(10):
+        get(sess, f"http://localhost:{port}/big/{i}")
+
+    # the first ones were evicted to make room for the last ones
+    get(sess, f"http://localhost:{port}/big/0")
+    get(sess, f"http://localhost:{port}/big/9")
+
+    assert server.requests.count("/big/0") == 2
+    assert server.requests.count("/big/9") == 1
+
+
+def test_cache_is_separate_per_database(server, sess):
+    """Check that a database isn't served the responses cached by another one"""
+    url = f"http://localhost:{server.server_address[1]}/per-database"
+
+    get(sess, url)
+
+    other_engine = create_engine("postgresql:///pre_existing")
+    other_sess = Session(other_engine)
+    other_sess.execute(text("create extension pg_net;"))
+    other_sess.commit()
+
+    try:
+        assert get(other_sess, url) == (200, "/per-database response")
+        assert server.requests.count("/per-database") == 2
+
+        # the other database has its own cached response now
+        get(other_sess, url)
+        assert server.requests.count("/per-database") == 2
+    finally:
+        other_sess.rollback()
+        other_sess.execute(text("drop extension pg_net;"))
+        other_sess.commit()
+        other_engine.dispose()
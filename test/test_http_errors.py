@@ -200,3 +200,277 @@ def test_it_keeps_working_after_server_returns_nothing(sess):
 
     assert status_code == 200
     assert count == 10
+
+
+def test_circuit_breaker_fails_fast(sess, autocommit_sess):
+    """after consecutive connection failures, requests to the host fail without a transfer"""
+
+    autocommit_sess.execute(text("alter system set pg_net.circuit_breaker_failures to 2;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    (request_id,) = sess.execute(text(
+        f"""
+        select net.http_get('http://localhost:{wrong_port}') from generate_series(1,2) offset 1;
+    """
+    )).fetchone()
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (request_id,) = sess.execute(text(
+        f"""
+        select net.http_get('http://localhost:{wrong_port}');
+    """
+    )).fetchone()
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (error_msg,) = sess.execute(text(
+        """
+        select error_msg from net._http_response where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert error_msg.startswith("Circuit breaker open for host localhost:6666")
+
+    # other ports of the same host aren't affected
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (status_code,) = sess.execute(text(
+        """
+        select status_code from net._http_response where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert status_code == 200
+
+    autocommit_sess.execute(text("alter system reset pg_net.circuit_breaker_failures;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+
+def test_bad_row_fails_alone(sess):
+    """a row the worker can't send gets an error response, the rest of its batch is still sent"""
+
+    # curl refuses urls over 8MB
+    (bad_id, good_id) = sess.execute(text(
+        """
+        with bad as (
+            insert into net.http_request_queue(method, url, headers, timeout_milliseconds)
+            values ('GET', 'http://localhost:8080/' || repeat('a', 9000000), '{}', 5000)
+            returning id
+        ), good as (
+            insert into net.http_request_queue(method, url, headers, timeout_milliseconds)
+            values ('GET', 'http://localhost:8080/pathological?status=200', '{}', 5000)
+            returning id
+        )
+        select bad.id, good.id from bad, good;
+    """
+    )).fetchone()
+    sess.execute(text("select net.wake();"))
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": good_id})
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": bad_id})
+
+    (status_code,) = sess.execute(text(
+        """
+        select status_code from net._http_response where id = :request_id;
+    """
+    ), {"request_id": good_id}).fetchone()
+
+    assert status_code == 200
+
+    (status_code, error_msg) = sess.execute(text(
+        """
+        select status_code, error_msg from net._http_response where id = :request_id;
+    """
+    ), {"request_id": bad_id}).fetchone()
+
+    assert status_code is None
+    assert "CURLOPT_URL" in error_msg
+
+    (count,) = sess.execute(text(
+        """
+        select count(*) from net.http_request_queue;
+    """
+    )).fetchone()
+
+    assert count == 0
+
+
+def test_full_queue_rejects_requests(sess, autocommit_sess):
+    """with pg_net.queue_max_depth reached, a new request fails with the reject policy"""
+
+    autocommit_sess.execute(text("alter system set pg_net.queue_max_depth to 1;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_get('http://localhost:8080/pathological?status=200') from generate_series(1,2);
+        """
+        ))
+
+    assert 'pg_net request queue is full' in str(execinfo.value)
+
+    sess.rollback()
+
+    autocommit_sess.execute(text("alter system reset pg_net.queue_max_depth;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+
+def test_full_queue_ignores_rolled_back_requests(sess, autocommit_sess):
+    """requests rolled back don't count in the queue depth"""
+
+    autocommit_sess.execute(text("alter system set pg_net.queue_max_depth to 1;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    ))
+    sess.rollback()
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+    sess.commit()
+
+    (status_code,) = sess.execute(text(
+        """
+        select (response).status_code from net._http_collect_response(:request_id, async:=false);
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert status_code == 200
+
+    autocommit_sess.execute(text("alter system reset pg_net.queue_max_depth;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+
+def test_full_queue_blocks_requests(sess, autocommit_sess):
+    """with the block policy, a new request waits for room in the queue up to pg_net.queue_block_timeout"""
+
+    autocommit_sess.execute(text("alter system set pg_net.queue_max_depth to 1;"))
+    autocommit_sess.execute(text("alter system set pg_net.queue_full_policy to 'block';"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    # the queue is full until the worker gets the response of this one
+    autocommit_sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200&delay=1');
+    """
+    ))
+
+    start = time.time()
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+    sess.commit()
+
+    elapsed = time.time() - start
+    assert 0.5 < elapsed < 5
+
+    (status_code,) = sess.execute(text(
+        """
+        select (response).status_code from net._http_collect_response(:request_id, async:=false);
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert status_code == 200
+
+    # the second request waits for the first one of its own transaction, which never leaves
+    sess.execute(text("set pg_net.queue_block_timeout to 500;"))
+
+    start = time.time()
+
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_get('http://localhost:8080/pathological?status=200') from generate_series(1,2);
+        """
+        ))
+
+    assert 'pg_net request queue is full' in str(execinfo.value)
+    assert time.time() - start >= 0.5
+
+    sess.rollback()
+
+    autocommit_sess.execute(text("alter system reset pg_net.queue_max_depth;"))
+    autocommit_sess.execute(text("alter system reset pg_net.queue_full_policy;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+
+def test_full_queue_drops_lower_priority_requests(sess, autocommit_sess):
+    """with the drop policy, a new request takes the place of the newest one with a lower priority"""
+
+    autocommit_sess.execute(text("alter system set pg_net.queue_max_depth to 2;"))
+    autocommit_sess.execute(text("alter system set pg_net.queue_full_policy to 'drop';"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    # both stay queued while they're in flight
+    (low_ids,) = autocommit_sess.execute(text(
+        """
+        select array_agg(net.http_get('http://localhost:8080/pathological?status=200&delay=2') order by n)
+        from generate_series(1,2) n;
+    """
+    )).fetchone()
+
+    # nothing has a lower priority than this one
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_get('http://localhost:8080/pathological?status=200');
+        """
+        ))
+
+    assert 'pg_net request queue is full' in str(execinfo.value)
+
+    sess.rollback()
+
+    (high_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200', priority:=1);
+    """
+    )).fetchone()
+    sess.commit()
+
+    responses = {}
+    for request_id in [*low_ids, high_id]:
+        responses[request_id] = sess.execute(text(
+            """
+            select (response).status_code, message from net._http_collect_response(:request_id, async:=false);
+        """
+        ), {"request_id": request_id}).fetchone()
+
+    assert responses[low_ids[0]][0] == 200
+    assert responses[low_ids[1]][0] is None
+    assert responses[low_ids[1]][1] == 'Dropped to make room for a higher priority request, the queue was full'
+    assert responses[high_id][0] == 200
+
+    # the dropped request in flight got no other response
+    (count,) = sess.execute(text(
+        """
+        select count(*) from net._http_response where id = :request_id;
+    """
+    ), {"request_id": low_ids[1]}).fetchone()
+
+    assert count == 1
+
+    autocommit_sess.execute(text("alter system reset pg_net.queue_max_depth;"))
+    autocommit_sess.execute(text("alter system reset pg_net.queue_full_policy;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
@@ -210,3 +210,34 @@ def test_http_get_null_headers(sess):
 
     assert response is not None
     assert "Hello world" in response[2]
+
+
+def test_http_get_coalesced(sess, autocommit_sess):
+    """identical GET requests share a transfer and every request gets the response"""
+
+    autocommit_sess.execute(text("alter system set pg_net.coalesce_gets to on;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    ids = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/request-id') from generate_series(1,10);
+    """
+    )).fetchall()
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": ids[-1][0]})
+
+    (status_code, count, transfers) = sess.execute(text(
+        """
+        select status_code, count(*), count(distinct content) from net._http_response group by status_code;
+    """
+    )).fetchone()
+
+    assert status_code == 200
+    assert count == 10
+    # nginx answers every request it gets with a new id
+    assert transfers == 1
+
+    autocommit_sess.execute(text("alter system reset pg_net.coalesce_gets;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
@@ -29,3 +29,84 @@ def test_http_headers_set(sess):
     assert response is not None
     assert response[0] == "SUCCESS"
     assert "pytest-header" in response[2]
+
+
+def test_http_headers_encoded_on_enqueue(sess):
+    """Check that headers are stored in the queue as `Name: value` lines"""
+    sess.execute(text(
+        """
+        select net.http_get(
+            url:='http://localhost:8080/headers',
+            headers:='{"pytest-header": "pytest-header"}'
+        );
+    """
+    ))
+
+    (headers,) = sess.execute(text(
+        """
+        select headers from net.http_request_queue order by id desc limit 1;
+    """
+    )).fetchone()
+
+    assert headers == ["pytest-header: pytest-header"]
+
+
+def test_http_headers_traceparent(sess):
+    """with pg_net.tracing on, requests inherit the caller's trace id and their span is recorded"""
+    sess.execute(text("set local pg_net.tracing to on;"))
+    sess.execute(text(
+        "set local pg_net.traceparent to '00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01';"
+    ))
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_get(url:='http://localhost:8080/headers');
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (content, trace_id, span_id, parent_span_id, completed) = sess.execute(text(
+        """
+        select r.content, s.trace_id, s.span_id, s.parent_span_id, s.completed_at >= s.enqueued_at
+        from net._http_response r join net._http_request_span s using (id)
+        where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert trace_id == "4bf92f3577b34da6a3ce929d0e0e4736"
+    assert parent_span_id == "00f067aa0ba902b7"
+    assert f"traceparent: 00-{trace_id}-{span_id}-01" in content
+    assert completed
+
+
+def test_http_headers_own_traceparent(sess):
+    """with pg_net.tracing on, a request's own traceparent header is sent as it is"""
+    sess.execute(text("set local pg_net.tracing to on;"))
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_get(
+            url:='http://localhost:8080/headers',
+            headers:='{"traceparent": "00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01"}'
+        );
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (content, trace_id, span_id) = sess.execute(text(
+        """
+        select r.content, s.trace_id, s.span_id
+        from net._http_response r join net._http_request_span s using (id)
+        where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert content.count("traceparent") == 1
+    assert "traceparent: 00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01" in content
+    assert (trace_id, span_id) == ("0af7651916cd43dd8448eb211c80319c", "b7ad6b7169203331")
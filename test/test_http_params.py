@@ -61,3 +61,27 @@ def test_http_post_url_params_set(sess):
     assert response is not None
     assert response[0] == "SUCCESS"
     assert "?hello=world" in response[2]
+
+
+def test_params_encoded_like_before(sess):
+    """the single pass encoder gives the url of the per param encoding"""
+
+    (new_url, old_url) = sess.execute(text(
+        """
+        with p(params) as (
+            select '{"a b": "c&d=e", "n": 1.5, "t": true, "skip": null, "o": {"x": [1, 2]}, "u": "ñ~._-"}'::jsonb
+        )
+        select
+            net._encode_url_with_params('http://localhost:8080/anything?x=1', params),
+            net._encode_url_with_params_array(
+                'http://localhost:8080/anything?x=1',
+                (select array_agg(net._urlencode_string(key) || '=' || net._urlencode_string(value)) from jsonb_each_text(params))
+            )
+        from p;
+    """
+    )).fetchone()
+
+    assert new_url == old_url
+    assert "a%20b=c%26d%3De" in new_url
+    assert "skip" not in new_url
+    assert new_url.startswith("http://localhost:8080/anything?x=1&")
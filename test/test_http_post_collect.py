@@ -1,3 +1,4 @@
+import pytest
 from sqlalchemy import text
 
 
@@ -218,3 +219,177 @@ def test_http_post_empty_body(sess):
     ).fetchone()
 
     assert 'POST' in str(body)
+
+
+def test_http_post_extract(sess):
+    """only the values extracted from a json response are stored"""
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_post(
+            url:='http://localhost:8080/post',
+            body:='{"user": {"name": "joe"}, "items": [1, 2]}',
+            extract:='{"name": "$.user.name", "second": "$.items[1]", "missing": "$.nope"}'
+        );
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (content, extracted) = sess.execute(text(
+        """
+        select content, extracted from net._http_response where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert content is None
+    assert extracted == {"name": "joe", "second": 2, "missing": None}
+
+
+def test_http_post_extract_with_bodies_that_are_not_json(sess):
+    """bodies that aren't json are stored as they are, alongside extracted json ones in the same batch"""
+
+    (json_id, text_id) = sess.execute(text(
+        """
+        select
+            net.http_post(
+                url:='http://localhost:8080/post',
+                body:='{"user": {"name": "joe"}}',
+                extract:='{"name": "$.user.name"}'
+            ),
+            net.http_get(
+                url:='http://localhost:8080/anything?not=json',
+                extract:='{"name": "$.user.name"}'
+            );
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": json_id})
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": text_id})
+
+    rows = dict((id, (content, extracted)) for (id, content, extracted) in sess.execute(text(
+        """
+        select id, content, extracted from net._http_response where id in (:json_id, :text_id);
+    """
+    ), {"json_id": json_id, "text_id": text_id}).fetchall())
+
+    assert rows[json_id] == (None, {"name": "joe"})
+    assert "?not=json" in rows[text_id][0]
+    assert rows[text_id][1] is None
+
+
+def test_http_post_extract_invalid_path(sess):
+    """an invalid json path fails the enqueue"""
+
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_post(
+                url:='http://localhost:8080/post',
+                extract:='{"name": "$$.user"}'
+            );
+        """
+        ))
+
+    assert "jsonpath" in str(execinfo.value)
+
+
+def test_http_post_chunked_body(sess, autocommit_sess):
+    """a body bigger than pg_net.body_chunk_size is stored in chunks"""
+
+    autocommit_sess.execute(text("alter system set pg_net.body_chunk_size to '1kB';"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_post(
+            url:='http://localhost:8080/post',
+            body:=jsonb_build_object('data', repeat('x', 4000))
+        );
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    (content, chunks, max_chunk_size, body) = sess.execute(text(
+        """
+        select
+            content,
+            (select count(*) from net._http_response_chunk c where c.id = r.id),
+            (select max(octet_length(c.data)) from net._http_response_chunk c where c.id = r.id),
+            (select convert_from(string_agg(c.data, ''::bytea order by c.seq), 'UTF8')::jsonb
+             from net._http_response_chunk c where c.id = r.id)
+        from net._http_response r where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    # how the body is split depends on the writes libcurl makes, only the chunk size is bounded
+    assert content is None
+    assert chunks > 1
+    assert max_chunk_size <= 1024
+    assert body == {"data": "x" * 4000}
+
+    autocommit_sess.execute(text("alter system reset pg_net.body_chunk_size;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+
+
+def test_http_post_aggregate(sess):
+    """posts with the same aggregate_key are sent as one json array, its response goes to each"""
+
+    ids = [id for (id,) in sess.execute(text(
+        """
+        select net.http_post(
+            url:='http://localhost:8080/post',
+            body:=jsonb_build_object('n', n),
+            aggregate_key:='events'
+        ) from generate_series(1, 3) n;
+    """
+    )).fetchall()]
+
+    sess.commit()
+
+    for request_id in ids:
+        sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    bodies = [body for (body,) in sess.execute(text(
+        """
+        select content::jsonb from net._http_response where id = any(:ids);
+    """
+    ), {"ids": ids}).fetchall()]
+
+    assert bodies == [[{"n": 1}, {"n": 2}, {"n": 3}]] * 3
+
+
+def test_http_post_aggregate_traced(sess):
+    """with pg_net.tracing on, each post is sent in its own json array and gets its own span"""
+    sess.execute(text("set local pg_net.tracing to on;"))
+
+    ids = [id for (id,) in sess.execute(text(
+        """
+        select net.http_post(
+            url:='http://localhost:8080/post',
+            body:=jsonb_build_object('n', n),
+            aggregate_key:='events'
+        ) from generate_series(1, 2) n;
+    """
+    )).fetchall()]
+
+    sess.commit()
+
+    for request_id in ids:
+        sess.execute(text("select net._await_response(:request_id);"), {"request_id": request_id})
+
+    rows = sess.execute(text(
+        """
+        select r.content::jsonb, (select count(*) from net._http_request_span s where s.id = r.id)
+        from net._http_response r where id = any(:ids) order by id;
+    """
+    ), {"ids": ids}).fetchall()
+
+    assert rows == [([{"n": 1}], 1), ([{"n": 2}], 1)]
@@ -0,0 +1,142 @@
+import pytest
+from sqlalchemy import text
+
+
+def test_http_prepared_uses_template(sess):
+    """Check that prepared requests get the template's url and headers plus their own params"""
+    sess.execute(text(
+        """
+        select net.prepare_request(
+            'pytest-headers',
+            'GET',
+            'http://localhost:8080/headers',
+            headers:='{"pytest-header": "pytest-header"}'
+        );
+    """
+    ))
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_prepared('pytest-headers', params:='{"hello": "world"}');
+    """
+    )).fetchone()
+
+    (url, params, headers) = sess.execute(text(
+        """
+        select url, params, headers from net.http_request_queue where id = :request_id;
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    # the queue row only carries the query string, the url comes from the template
+    assert url is None
+    assert params == "hello=world"
+    assert headers is None
+
+    sess.commit()
+
+    response = sess.execute(
+        text(
+            """
+        select * from net._http_collect_response(:request_id, async:=false);
+    """
+        ),
+        {"request_id": request_id},
+    ).fetchone()
+
+    assert response is not None
+    assert response[0] == "SUCCESS"
+    assert "/headers?hello=world" in response[2]
+    assert "pytest-header" in response[2]
+
+    # the worker sees the replaced template once it's committed
+    sess.execute(text(
+        """
+        select net.prepare_request(
+            'pytest-headers',
+            'GET',
+            'http://localhost:8080/headers',
+            headers:='{"other-header": "other-header"}'
+        );
+    """
+    ))
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_prepared('pytest-headers');
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    response = sess.execute(
+        text(
+            """
+        select * from net._http_collect_response(:request_id, async:=false);
+    """
+        ),
+        {"request_id": request_id},
+    ).fetchone()
+
+    assert response[0] == "SUCCESS"
+    assert "other-header" in response[2]
+    assert "pytest-header" not in response[2]
+
+    (dropped,) = sess.execute(text(
+        """
+        select net.drop_prepared_request('pytest-headers');
+    """
+    )).fetchone()
+    sess.commit()
+
+    assert dropped is True
+
+
+def test_http_prepared_template_user_agent(sess):
+    """Check that a template's own User-Agent replaces pg_net's"""
+    sess.execute(text(
+        """
+        select net.prepare_request(
+            'pytest-agent',
+            'GET',
+            'http://localhost:8080/headers',
+            headers:='{"User-Agent": "pytest-agent"}'
+        );
+    """
+    ))
+
+    (request_id,) = sess.execute(text(
+        """
+        select net.http_prepared('pytest-agent');
+    """
+    )).fetchone()
+
+    sess.commit()
+
+    response = sess.execute(
+        text(
+            """
+        select * from net._http_collect_response(:request_id, async:=false);
+    """
+        ),
+        {"request_id": request_id},
+    ).fetchone()
+
+    assert response[0] == "SUCCESS"
+    assert "User-Agent: pytest-agent" in response[2]
+    assert "pg_net/" not in response[2]
+
+    sess.execute(text("select net.drop_prepared_request('pytest-agent');"))
+    sess.commit()
+
+
+def test_http_prepared_missing_template(sess):
+    """Check that a request can't be made from a template that doesn't exist"""
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_prepared('pytest-missing');
+        """
+        ))
+    assert 'request template "pytest-missing" doesn\'t exist' in str(execinfo.value)
+
+    sess.rollback()
@@ -0,0 +1,69 @@
+import pytest
+from sqlalchemy import text
+
+
+def test_http_request_sync_get(sess):
+    """net.http_request_sync returns the response without going through the queue"""
+
+    (status_code, body) = sess.execute(text(
+        """
+        select status_code, body from net.http_request_sync('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+
+    assert status_code == 200
+    assert body == "ok"
+
+    (queued, responses) = sess.execute(text(
+        """
+        select (select count(*) from net.http_request_queue), (select count(*) from net._http_response);
+    """
+    )).fetchone()
+
+    assert queued == 0
+    assert responses == 0
+
+
+def test_http_request_sync_post(sess):
+    """net.http_request_sync sends the body and headers"""
+
+    body = sess.execute(text(
+        """
+        select body::jsonb from net.http_request_sync(
+            'http://localhost:8080/post',
+            method := 'POST',
+            headers := '{"Content-Type": "application/json"}',
+            body := '{"hello": "world"}'
+        );
+    """
+    )).scalar_one()
+
+    assert body == {"hello": "world"}
+
+
+def test_http_request_sync_timeout(sess):
+    """net.http_request_sync raises an error when the request times out"""
+
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_request_sync('http://localhost:8080/pathological?delay=1', timeout_milliseconds := 100);
+        """
+        ))
+
+    assert "Timeout" in str(execinfo.value)
+
+
+def test_http_request_sync_statement_timeout(sess):
+    """net.http_request_sync is cancelled by statement_timeout"""
+
+    sess.execute(text("set local statement_timeout to '200ms';"))
+
+    with pytest.raises(Exception) as execinfo:
+        sess.execute(text(
+            """
+            select net.http_request_sync('http://localhost:8080/pathological?delay=2', timeout_milliseconds := 5000);
+        """
+        ))
+
+    assert "canceling statement due to statement timeout" in str(execinfo.value)
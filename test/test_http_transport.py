@@ -0,0 +1,119 @@
+import os
+import socketserver
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+from sqlalchemy import text
+
+
+class RecordingHandler(BaseHTTPRequestHandler):
+    """Answers every request with an empty 200 and records its request line"""
+
+    def do_HEAD(self):
+        self.server.request_lines.append(self.requestline)
+        self.send_response(200)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def do_GET(self):
+        self.do_HEAD()
+
+    def log_message(self, format, *args):
+        pass
+
+
+class UnixHTTPServer(socketserver.UnixStreamServer):
+    def get_request(self):
+        request, _ = super().get_request()
+        # BaseHTTPRequestHandler expects a (host, port) client address
+        return request, ("localhost", 0)
+
+
+def start_server(server):
+    server.request_lines = []
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def wait_for_request_line(server, expected):
+    for _ in range(50):
+        if expected in server.request_lines:
+            return True
+        time.sleep(0.1)
+    return False
+
+
+def test_warm_origins_use_proxy(sess, autocommit_sess):
+    """Check that the connections opened for pg_net.warm_origins go through pg_net.proxy"""
+    server = start_server(HTTPServer(("localhost", 0), RecordingHandler))
+    proxy_port = server.server_address[1]
+
+    autocommit_sess.execute(text(f"alter system set pg_net.proxy to 'http://localhost:{proxy_port}'"))
+    autocommit_sess.execute(text("alter system set pg_net.warm_origins to 'http://localhost:8080'"))
+    autocommit_sess.execute(text("select net.worker_restart()"))
+    autocommit_sess.execute(text("select net.wait_until_running()"))
+
+    try:
+        # a proxy gets the absolute url in the request line
+        assert wait_for_request_line(server, "HEAD http://localhost:8080/ HTTP/1.1")
+
+        (request_id,) = autocommit_sess.execute(text(
+            """
+            select net.http_get('http://localhost:8080/anything');
+        """
+        )).fetchone()
+
+        (status,) = autocommit_sess.execute(text(
+            """
+            select status from net._http_collect_response(:request_id, async:=false);
+        """
+        ), {"request_id": request_id}).fetchone()
+
+        assert status == "SUCCESS"
+        assert "GET http://localhost:8080/anything HTTP/1.1" in server.request_lines
+    finally:
+        autocommit_sess.execute(text("alter system reset pg_net.proxy"))
+        autocommit_sess.execute(text("alter system reset pg_net.warm_origins"))
+        autocommit_sess.execute(text("select net.worker_restart()"))
+        autocommit_sess.execute(text("select net.wait_until_running()"))
+        server.shutdown()
+
+
+def test_warm_origins_use_unix_socket(sess, autocommit_sess):
+    """Check that the connections opened for pg_net.warm_origins go through pg_net.unix_sockets"""
+    socket_path = os.path.join(tempfile.mkdtemp(), "pg_net.sock")
+    server = start_server(UnixHTTPServer(socket_path, RecordingHandler))
+    os.chmod(os.path.dirname(socket_path), 0o777)
+    os.chmod(socket_path, 0o777)
+
+    autocommit_sess.execute(text(f"alter system set pg_net.unix_sockets to 'sidecar={socket_path}'"))
+    autocommit_sess.execute(text("alter system set pg_net.warm_origins to 'http://sidecar'"))
+    autocommit_sess.execute(text("select net.worker_restart()"))
+    autocommit_sess.execute(text("select net.wait_until_running()"))
+
+    try:
+        assert wait_for_request_line(server, "HEAD / HTTP/1.1")
+
+        (request_id,) = autocommit_sess.execute(text(
+            """
+            select net.http_get('http://sidecar/path');
+        """
+        )).fetchone()
+
+        (status,) = autocommit_sess.execute(text(
+            """
+            select status from net._http_collect_response(:request_id, async:=false);
+        """
+        ), {"request_id": request_id}).fetchone()
+
+        assert status == "SUCCESS"
+        assert "GET /path HTTP/1.1" in server.request_lines
+    finally:
+        autocommit_sess.execute(text("alter system reset pg_net.unix_sockets"))
+        autocommit_sess.execute(text("alter system reset pg_net.warm_origins"))
+        autocommit_sess.execute(text("select net.worker_restart()"))
+        autocommit_sess.execute(text("select net.wait_until_running()"))
+        server.shutdown()
+        os.remove(socket_path)
@@ -37,3 +37,77 @@ def test_net_appname(sess):
         )
     ).fetchone()
     assert count == 1
+
+def test_max_databases_serves_databases_with_pg_net():
+    """Check that with pg_net.max_databases only the databases with pg_net get a worker slot"""
+
+    def restart():
+        subprocess.run(["pg_ctl", "restart", "-D", os.getenv('PGDATA')])
+        # give it some time to finish restart
+        time.sleep(1)
+
+    def pg_net_databases(session):
+        return [datname for (datname,) in session.execute(text(
+            """
+            select datname from pg_stat_activity
+            where backend_type ilike '%pg_net%worker' order by datname;
+        """
+        )).fetchall()]
+
+    engine = create_engine("postgresql:///postgres")
+    tmp_sess = Session(engine.execution_options(isolation_level="AUTOCOMMIT"))
+
+    tmp_sess.execute(text("create database pytest_without_pg_net;"))
+    # a single slot besides the one of pg_net.database_name
+    tmp_sess.execute(text("alter system set pg_net.max_databases to 2;"))
+    engine.dispose()
+
+    restart()
+
+    engine = create_engine("postgresql:///postgres")
+    tmp_sess = Session(engine.execution_options(isolation_level="AUTOCOMMIT"))
+    other_engine = create_engine("postgresql:///pre_existing")
+    other_sess = Session(other_engine.execution_options(isolation_level="AUTOCOMMIT"))
+
+    # the database without pg_net didn't take the free slot
+    assert pg_net_databases(tmp_sess) == ["postgres"]
+
+    other_sess.execute(text("create extension pg_net;"))
+
+    (request_id,) = other_sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+
+    (status,) = other_sess.execute(text(
+        """
+        select status from net._http_collect_response(:request_id, async:=false);
+    """
+    ), {"request_id": request_id}).fetchone()
+
+    assert status == "SUCCESS"
+    assert pg_net_databases(tmp_sess) == ["postgres", "pre_existing"]
+
+    engine.dispose()
+    other_engine.dispose()
+
+    # the worker of pg_net.database_name launches the one of pre_existing now that it has pg_net
+    restart()
+
+    engine = create_engine("postgresql:///postgres")
+    tmp_sess = Session(engine.execution_options(isolation_level="AUTOCOMMIT"))
+
+    time.sleep(1)
+    assert pg_net_databases(tmp_sess) == ["postgres", "pre_existing"]
+
+    other_engine = create_engine("postgresql:///pre_existing")
+    other_sess = Session(other_engine.execution_options(isolation_level="AUTOCOMMIT"))
+    other_sess.execute(text("drop extension pg_net;"))
+    other_engine.dispose()
+
+    tmp_sess.execute(text("drop database pytest_without_pg_net with (force);"))
+    tmp_sess.execute(text("alter system reset pg_net.max_databases;"))
+    engine.dispose()
+
+    restart()
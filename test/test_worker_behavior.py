@@ -6,6 +6,8 @@ import pytest
 import time
 import subprocess
 import os
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 
 def test_worker_will_not_block_drop_database(autocommit_sess):
     """the worker will not block a session doing drop database"""
@@ -166,6 +168,189 @@ def test_can_delete_rows_while_processing_queue(sess, autocommit_sess):
     autocommit_sess.execute(text("select net.wait_until_running()"))
 
 
+def test_tenants_take_turns(sess, autocommit_sess):
+    """a tenant's backlog doesn't delay the requests of another tenant enqueued after it"""
+
+    autocommit_sess.execute(text("alter system set pg_net.batch_size to '2';"))
+    autocommit_sess.execute(text("select net.worker_restart();"))
+    autocommit_sess.execute(text("select net.wait_until_running();"))
+
+    sess.execute(text("set local pg_net.tenant to 'bulk';"))
+    bulk_ids = [id for (id,) in sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200') from generate_series(1,10);
+    """
+    )).fetchall()]
+
+    sess.execute(text("set local pg_net.tenant to 'other';"))
+    (other_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+
+    (tenants,) = sess.execute(text(
+        """
+        select array_agg(distinct tenant order by tenant) from net.http_request_queue;
+    """
+    )).fetchone()
+    assert tenants == ['bulk', 'other']
+
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": bulk_ids[-1]})
+
+    # the first batch had one request of each tenant
+    (other_first,) = sess.execute(text(
+        """
+        select
+            (select created from net._http_response where id = :other_id) <
+            (select created from net._http_response where id = :bulk_id);
+    """
+    ), {"other_id": other_id, "bulk_id": bulk_ids[2]}).fetchone()
+    assert other_first
+
+    autocommit_sess.execute(text("alter system reset pg_net.batch_size"))
+    autocommit_sess.execute(text("select net.worker_restart()"))
+    autocommit_sess.execute(text("select net.wait_until_running()"))
+
+
+def test_cancel_requests(sess):
+    """cancelled requests get a cancelled response and their transfers stop taking a slot"""
+
+    (slow_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200&delay=5', timeout_milliseconds := 10000);
+    """
+    )).fetchone()
+    sess.commit()
+
+    # leave time for the transfer to start
+    time.sleep(0.5)
+
+    (cancelled,) = sess.execute(text(
+        """
+        select net.cancel(:request_id);
+    """
+    ), {"request_id": slow_id}).fetchone()
+    sess.commit()
+
+    assert cancelled is True
+
+    start = time.time()
+
+    # the worker only takes the next batch once the slow transfer is stopped
+    (fast_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """
+    )).fetchone()
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:request_id);"), {"request_id": fast_id})
+
+    assert time.time() - start < 3
+
+    (count, error_msg) = sess.execute(text(
+        """
+        select count(*), max(error_msg) from net._http_response where id = :request_id;
+    """
+    ), {"request_id": slow_id}).fetchone()
+
+    assert count == 1
+    assert error_msg == 'Request cancelled'
+
+    # the bulk variant skips the requests that already got a response
+    ids = [id for (id,) in sess.execute(text(
+        """
+        select net.cancel(array[:slow_id, :fast_id]);
+    """
+    ), {"slow_id": slow_id, "fast_id": fast_id}).fetchall()]
+
+    assert ids == []
+
+
+class ConcurrencyHandler(BaseHTTPRequestHandler):
+    """Answers after a delay, with a 503 on /fail, recording how many requests were in flight"""
+
+    def do_GET(self):
+        with self.server.lock:
+            self.server.in_flight += 1
+            self.server.concurrency.append(self.server.in_flight)
+
+        time.sleep(0.1)
+
+        with self.server.lock:
+            self.server.in_flight -= 1
+
+        self.send_response(503 if self.path == "/fail" else 200)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def log_message(self, format, *args):
+        pass
+
+
+class ConcurrencyServer(ThreadingHTTPServer):
+    request_queue_size = 64
+
+
+def test_adaptive_concurrency_sends_every_request(sess, autocommit_sess):
+    """an overloaded host gets fewer requests in flight, and more again once it recovers"""
+    server = ConcurrencyServer(("localhost", 0), ConcurrencyHandler)
+    server.lock = threading.Lock()
+    server.in_flight = 0
+    server.concurrency = []
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    port = server.server_address[1]
+
+    autocommit_sess.execute(text("alter system set pg_net.adaptive_concurrency to on;"))
+    autocommit_sess.execute(text("alter system set pg_net.batch_size to 10;"))
+    autocommit_sess.execute(text("select pg_reload_conf();"))
+    autocommit_sess.execute(text("select net.worker_restart();"))
+    autocommit_sess.execute(text("select net.wait_until_running();"))
+
+    def send(path, count):
+        ids = [id for (id,) in sess.execute(text(
+            f"""
+            select net.http_get('http://localhost:{port}{path}') from generate_series(1,{count});
+        """
+        )).fetchall()]
+        sess.commit()
+
+        sess.execute(text("select net._await_response(id) from unnest(:ids) id;"), {"ids": ids})
+        return ids
+
+    try:
+        # the host starts at the ceiling, the 503s halve its limit
+        send("/fail", 10)
+        assert max(server.concurrency) == 10
+
+        server.concurrency = []
+        ids = send("/ok", 80)
+
+        (count, status_codes) = sess.execute(text(
+            """
+            select count(*), array_agg(distinct status_code)
+            from net._http_response where id = any(:ids);
+        """
+        ), {"ids": ids}).fetchone()
+
+        assert count == 80
+        assert status_codes == [200]
+
+        # the batches are sent one after the other, the first two start from the cut limit and the
+        # following ones grow back to the ceiling
+        assert max(server.concurrency[:10]) <= 6
+        assert max(server.concurrency[-10:]) >= 9
+    finally:
+        server.shutdown()
+
+        autocommit_sess.execute(text("alter system reset pg_net.adaptive_concurrency;"))
+        autocommit_sess.execute(text("alter system reset pg_net.batch_size;"))
+        autocommit_sess.execute(text("select pg_reload_conf();"))
+
+
 def test_truncate_wait_while_processing_queue(sess, autocommit_sess):
     """a truncate will not wait until the worker is done processing all requests"""
 
@@ -318,6 +503,79 @@ def test_new_requests_get_attended_asap(sess):
     assert count == 10
 
 
+def test_responses_committed_while_batch_in_flight(sess, autocommit_sess):
+    """the responses of a batch are committed as they arrive, the slow requests stay queued until
+    they get theirs"""
+
+    (slow_id,) = sess.execute(text("""
+        select net.http_get('http://localhost:8080/pathological?status=200&delay=3');
+    """)).fetchone()
+
+    fast_ids = [id for (id,) in sess.execute(text("""
+        select net.http_get('http://localhost:8080/pathological?status=200') from generate_series(1,3);
+    """)).fetchall()]
+    sess.commit()
+
+    # leave time for the fast requests, the slow one is still in flight
+    time.sleep(1)
+
+    (fast_responses,) = autocommit_sess.execute(text("""
+        select count(*) from net._http_response where id = any(:ids) and status_code = 200;
+    """), {"ids": fast_ids}).fetchone()
+    assert fast_responses == 3
+
+    (queued,) = autocommit_sess.execute(text("""
+        select array_agg(id) from net.http_request_queue;
+    """)).fetchone()
+    assert queued == [slow_id]
+
+    sess.execute(text("select net._await_response(:id);"), {"id": slow_id})
+
+    (responses,) = autocommit_sess.execute(text("""
+        select count(*) from net._http_response where id = any(:ids);
+    """), {"ids": fast_ids + [slow_id]}).fetchone()
+    assert responses == 4
+
+    (queued,) = autocommit_sess.execute(text("""
+        select count(*) from net.http_request_queue;
+    """)).fetchone()
+    assert queued == 0
+
+
+def test_worker_profile(sess, autocommit_sess):
+    """net.worker_profile accumulates the time of each phase of the worker and can be reset"""
+
+    autocommit_sess.execute(text("select net.worker_profile(reset => true);"))
+
+    (request_id,) = sess.execute(text("""
+        select net.http_get('http://localhost:8080/pathological?status=200');
+    """)).fetchone()
+    sess.commit()
+
+    sess.execute(text("select net._await_response(:id);"), {"id": request_id})
+
+    profile = {
+        phase: (calls, total_ms, max_ms)
+        for phase, calls, total_ms, max_ms in autocommit_sess.execute(text("""
+            select * from net.worker_profile();
+        """)).fetchall()
+    }
+
+    assert set(profile) == {"expire", "dequeue", "init", "transfer", "insert", "commit"}
+
+    for phase in ["dequeue", "init", "transfer", "insert", "commit"]:
+        calls, total_ms, max_ms = profile[phase]
+        assert calls >= 1
+        assert 0 <= max_ms <= total_ms
+
+    autocommit_sess.execute(text("select net.worker_profile(reset => true);"))
+
+    (calls,) = autocommit_sess.execute(text("""
+        select calls from net.worker_profile() where phase = 'insert';
+    """)).fetchone()
+    assert calls == 0
+
+
 def test_direct_inserts_no_requests(sess):
     """direct insertions to the net.http_request_queue doesn't trigger new requests"""
 
@@ -641,6 +899,57 @@ def test_worker_reports_activity_in_pg_stat_activity(sess, autocommit_sess):
 
 
 
+def test_transfer_threads_send_every_request(sess, autocommit_sess):
+    """requests sent by the transfer threads get their responses, including the failed ones"""
+
+    autocommit_sess.execute(text("alter system set pg_net.transfer_threads to 2;"))
+    autocommit_sess.execute(text("select net.worker_restart();"))
+    autocommit_sess.execute(text("select net.wait_until_running();"))
+
+    ids = [id for (id,) in sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200') from generate_series(1,20);
+    """
+    )).fetchall()]
+
+    (timeout_id,) = sess.execute(text(
+        """
+        select net.http_get('http://localhost:8080/pathological?status=200&delay=2', timeout_milliseconds := 500);
+    """
+    )).fetchone()
+    sess.commit()
+
+    sess.execute(text("select net._await_response(id) from unnest(:ids) id;"), {"ids": ids + [timeout_id]})
+
+    (count, status_codes) = sess.execute(text(
+        """
+        select count(*), array_agg(distinct status_code)
+        from net._http_response where id = any(:ids);
+    """
+    ), {"ids": ids}).fetchone()
+
+    assert count == 20
+    assert status_codes == [200]
+
+    (timed_out,) = sess.execute(text(
+        """
+        select timed_out from net._http_response where id = :timeout_id;
+    """
+    ), {"timeout_id": timeout_id}).fetchone()
+
+    assert timed_out is True
+
+    # the worker runs its transfer threads, every transfer goes through them then
+    (pid,) = autocommit_sess.execute(text(
+        "select pid from pg_stat_activity where backend_type ilike '%pg_net%' and datname = current_database();"
+    )).fetchone()
+    assert len(os.listdir(f"/proc/{pid}/task")) >= 3
+
+    autocommit_sess.execute(text("alter system reset pg_net.transfer_threads;"))
+    autocommit_sess.execute(text("select net.worker_restart();"))
+    autocommit_sess.execute(text("select net.wait_until_running();"))
+
+
 def test_worker_idles_when_net_schema_exists_without_extension(sess, autocommit_sess):
     """when a schema named "net" exists but the pg_net tables don't (e.g. another
     extension installed into a schema named "net"), the worker should treat the